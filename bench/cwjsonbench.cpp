@@ -0,0 +1,617 @@
+/*
+   Copyright (c) 2012 Sergej Kravcenko
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/*
+   cwjsonbench - microbenchmarks for parser and printer kernels. Every case runs on generated input with one
+   parameter varied (string length, escape density, digit count, exponent range...), so a change in a kernel shows
+   up as a change in the affected rows only. Input is generated from fixed seed, runs are comparable between builds.
+
+   Usage: cwjsonbench [--list] [--time seconds] [case-prefix...]
+
+   Needs C++11: g++ -std=c++11 -O2 bench/cwjsonbench.cpp cwjson.cpp -o cwjsonbench
+
+   "shared/" cases also check SharedDocument snapshots for consistency and exit with an error on the first bad one. 
+   Built with -fsanitize=thread they are the race check for the reader protocol:
+   g++ -std=c++11 -O1 -g -fsanitize=thread bench/cwjsonbench.cpp cwjson.cpp -o cwjsonbench-tsan -lpthread
+*/
+
+#include "../cwjson.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <math.h>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+// Amount of work done by one pass of a case
+struct Work
+{
+   Work(size_t bytes = 0, size_t items = 0) : bytes(bytes), items(items) {}
+
+   size_t bytes;
+   size_t items;
+};
+
+struct Case
+{
+   std::string           name;
+   std::function<Work()> pass;
+   std::function<void()> prepare;   // untimed, runs before every pass
+};
+
+std::vector<Case> &cases()
+{
+   static std::vector<Case> list;
+   return list;
+}
+
+void add(const std::string &name, std::function<Work()> pass, std::function<void()> prepare = nullptr)
+{
+   Case item;
+   item.name    = name;
+   item.pass    = pass;
+   item.prepare = prepare;
+   cases().push_back(item);
+}
+
+// Result of a pass is stored here, so compiler can't drop the work
+volatile double g_sink;
+
+// Small LCG, same input on every run and platform
+class Random
+{
+public:
+   Random(unsigned seed) : m_state(seed) {}
+
+   unsigned next()
+   {
+      m_state = m_state * 1103515245u + 12345u;
+      return (m_state >> 8) & 0xFFFFFF;
+   }
+
+   unsigned range(unsigned limit) { return next() % limit; }
+
+private:
+   unsigned m_state;
+};
+
+// Input generators
+
+std::string stringBody(Random &random, size_t length, int escapePercent)
+{
+   static const char *escapes[] = { "\\n", "\\t", "\\\"", "\\\\", "\\u00e9", "\\u20ac", "\\ud83d\\ude00" };
+
+   std::string body;
+   while (body.size() < length)
+   {
+      if ((int)random.range(100) < escapePercent)
+         body += escapes[random.range(sizeof(escapes) / sizeof(escapes[0]))];
+      else
+         body += (char)('a' + random.range(26));
+   }
+   return body;
+}
+
+// Quoted strings back to back, about 1 MB in total
+std::string strings(size_t length, int escapePercent)
+{
+   Random      random(1);
+   std::string text;
+   while (text.size() < (1 << 20))
+      text += "\"" + stringBody(random, length, escapePercent) + "\"";
+   return text;
+}
+
+double number(Random &random, int digits, int exponent)
+{
+   double mantissa = 1 + random.range(9);
+   for (int i = 1; i < digits; ++i)
+      mantissa = mantissa * 10 + random.range(10);
+
+   // scale down to 1 <= m < 10, then spread exponent over [-exponent, exponent]
+   for (int i = 1; i < digits; ++i)
+      mantissa /= 10;
+
+   int power = exponent ? (int)random.range(2 * exponent + 1) - exponent : 0;
+   return (random.range(2) ? -mantissa : mantissa) * pow(10.0, power);
+}
+
+std::vector<double> numbers(int digits, int exponent, size_t count)
+{
+   Random              random(2);
+   std::vector<double> list;
+   for (size_t i = 0; i < count; ++i)
+      list.push_back(number(random, digits, exponent));
+   return list;
+}
+
+// Numbers in JSON form separated by ','
+std::string numberText(int digits, int exponent)
+{
+   Random      random(3);
+   std::string text;
+   char        buffer[64];
+   while (text.size() < (1 << 20))
+   {
+      // integers without exponent part exercise the common case
+      if (!exponent)
+         snprintf(buffer, sizeof(buffer), "%.0f,", floor(number(random, digits, 0) * pow(10.0, digits - 1)));
+      else
+         snprintf(buffer, sizeof(buffer), "%.*e,", digits - 1, number(random, digits, exponent));
+      text += buffer;
+   }
+   return text;
+}
+
+// Kernel cases
+
+void whitespaceCases()
+{
+   const size_t runs[] = { 1, 4, 16, 256 };
+   for (size_t run : runs)
+   {
+      Random      random(4);
+      std::string text;
+      while (text.size() < (1 << 20))
+      {
+         for (size_t i = 0; i < run; ++i)
+            text += " \t\r\n"[random.range(4)];
+         text += 'x';
+      }
+
+      add("whitespace/run=" + std::to_string(run), [text]() {
+         const char *ptr   = text.c_str();
+         size_t      items = 0;
+         while (*ptr)
+         {
+            ptr = cwjson::Scanner::whitespace(ptr) + 1;
+            items++;
+         }
+         return Work(text.size(), items);
+      });
+   }
+}
+
+void stringCases()
+{
+   const size_t lengths[] = { 8, 64, 1024, 65536 };
+   const int    escapes[] = { 0, 1, 10 };
+   for (size_t length : lengths)
+   {
+      for (int escape : escapes)
+      {
+         std::string text = strings(length, escape);
+         std::string suffix = "/len=" + std::to_string(length) + "/esc=" + std::to_string(escape) + "%";
+
+         add("parseString" + suffix, [text]() {
+            std::string value;
+            bool        escaped;
+            const char *ptr   = text.c_str();
+            size_t      items = 0;
+            while (*ptr)
+            {
+               ptr = cwjson::Scanner::parseString(value, escaped, ptr);
+               items++;
+            }
+            g_sink = (double)value.size();
+            return Work(text.size(), items);
+         });
+
+         // printer input is the decoded text
+         std::vector<std::string> values;
+         std::string              value;
+         for (const char *ptr = text.c_str(); *ptr; )
+         {
+            ptr = cwjson::Scanner::parseString(value, ptr);
+            values.push_back(value);
+         }
+
+         add("printEscapedString" + suffix, [values]() {
+            std::ostringstream out;
+            cwjson::Printer    printer(out);
+            for (const std::string &value : values)
+               printer.printEscapedString(value);
+            return Work((size_t)out.tellp(), values.size());
+         });
+      }
+   }
+}
+
+void numberCases()
+{
+   const int digits[]    = { 1, 4, 9, 17 };
+   const int exponents[] = { 0, 10, 300 };
+   for (int digit : digits)
+   {
+      for (int exponent : exponents)
+      {
+         std::string text   = numberText(digit, exponent);
+         std::string suffix = "/digits=" + std::to_string(digit) + "/exp=" + std::to_string(exponent);
+
+         add("parseNumber" + suffix, [text]() {
+            double      sum   = 0;
+            double      value;
+            const char *ptr   = text.c_str();
+            size_t      items = 0;
+            while (*ptr)
+            {
+               ptr = cwjson::Scanner::parseNumber(value, ptr) + 1;
+               sum += value;
+               items++;
+            }
+            g_sink = sum;
+            return Work(text.size(), items);
+         });
+
+         std::vector<double> values = numbers(digit, exponent, 1 << 16);
+         add("printNumber" + suffix, [values]() {
+            std::ostringstream out;
+            cwjson::Printer    printer(out);
+            for (double value : values)
+            {
+               printer.printNumber(value);
+               out << ',';
+            }
+            return Work((size_t)out.tellp(), values.size());
+         });
+      }
+   }
+}
+
+void unicodeCases()
+{
+   Random      random(5);
+   std::string text;
+   while (text.size() < (1 << 20))
+   {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), random.range(2) ? "%04x" : "%04X", random.range(0x10000));
+      text += buffer;
+   }
+
+   add("parseUnicode", [text]() {
+      int         sum   = 0;
+      int         value;
+      const char *ptr   = text.c_str();
+      size_t      items = 0;
+      while (*ptr)
+      {
+         ptr = cwjson::Scanner::parseUnicode(value, ptr);
+         sum += value;
+         items++;
+      }
+      g_sink = sum;
+      return Work(text.size(), items);
+   });
+}
+
+// Same document parsed and printed as UTF-8 and as UTF-16LE, plus the standalone transcoders
+void documentCases()
+{
+   Random             random(6);
+   std::ostringstream out;
+   out << "[";
+   for (int i = 0; i < 20000; ++i)
+   {
+      out << (i ? "," : "") << "{\"id\":" << i << ",\"price\":" << number(random, 6, 3)
+          << ",\"name\":\"" << stringBody(random, 16, 0) << "\",\"text\":\"" << stringBody(random, 64, 2)
+          << " gr\xC3\xBC\xC3\x9F \xE2\x82\xAC\",\"tags\":[\"a\",\"b\"],\"ok\":true}";
+   }
+   out << "]";
+
+   std::string utf8 = out.str();
+   std::string utf16;
+   cwjson::Utf16::fromUtf8(utf16, utf8.data(), utf8.size());
+
+   add("document/utf8/parse", [utf8]() {
+      cwjson::Root root;
+      root.parse(utf8.c_str());
+      return Work(utf8.size(), 1);
+   });
+
+   add("document/utf16/parse", [utf16]() {
+      cwjson::Root root;
+      root.parseUtf16(utf16.data(), utf16.size());
+      return Work(utf16.size(), 1);
+   });
+
+   std::shared_ptr<cwjson::Root> root(new cwjson::Root(utf8.c_str()));
+
+   add("document/utf8/print", [root]() {
+      std::ostringstream text;
+      root->print(text);
+      return Work((size_t)text.tellp(), 1);
+   });
+
+   add("document/utf16/print", [root]() {
+      std::ostringstream text;
+      root->printUtf16(text);
+      return Work((size_t)text.tellp(), 1);
+   });
+
+   add("transcode/toUtf8", [utf16]() {
+      std::string text;
+      cwjson::Utf16::toUtf8(text, utf16.data(), utf16.size());
+      return Work(utf16.size(), 1);
+   });
+
+   add("transcode/fromUtf8", [utf8]() {
+      std::string text;
+      cwjson::Utf16::fromUtf8(text, utf8.data(), utf8.size());
+      return Work(utf8.size(), 1);
+   });
+}
+
+// Bulk operations on a 1M element array, every pass starts from a fresh copy of the same array
+void arrayCases()
+{
+   const int          count = 1 << 20;
+   Random             random(7);
+   std::ostringstream out;
+   out << "[";
+   for (int i = 0; i < count; ++i)
+      out << (i ? "," : "") << random.range(count);
+   out << "]";
+
+   std::shared_ptr<cwjson::Root> source(new cwjson::Root(out.str().c_str()));
+   std::shared_ptr<cwjson::Root> root(new cwjson::Root());
+   // the heap hands freed nodes out again in the order they were freed, freeing them in address order gives every 
+   // pass the same compact layout instead of the one the previous pass shuffled
+   std::function<void()> fresh = [source, root]() {
+      if (root->firstChild())
+         root->getArray().sort([](const cwjson::Value &a, const cwjson::Value &b) { return &a < &b; });
+      root->clear();
+      root->linkValue(source->getArray().clone());
+   };
+
+   auto value = [](const cwjson::Value &item) { return item.toNumber().getValue(); };
+
+   add("array/sort", [root, value]() {
+      root->getArray().sort([value](const cwjson::Value &a, const cwjson::Value &b) { return value(a) < value(b); });
+      return Work(0, count);
+   }, fresh);
+
+   add("array/reverse", [root]() {
+      root->getArray().reverse();
+      return Work(0, count);
+   }, fresh);
+
+   add("array/partition", [root, value]() {
+      g_sink = root->getArray().partition([value](const cwjson::Value &item) { return (int)value(item) % 2 == 0; });
+      return Work(0, count);
+   }, fresh);
+
+   // values in [0, 4) so that about a quarter of the neighbours are duplicates
+   add("array/unique", [root, value]() {
+      g_sink = root->getArray().unique([value](const cwjson::Value &a, const cwjson::Value &b) {
+         return (int)value(a) % 4 == (int)value(b) % 4;
+      });
+      return Work(0, count);
+   }, fresh);
+
+   add("array/removeIf", [root, value]() {
+      g_sink = root->getArray().removeIf([value](const cwjson::Value &item) { return value(item) < count / 2; });
+      return Work(0, count);
+   }, fresh);
+}
+
+// Document version where every element equals the version number
+std::string sharedVersion(int version)
+{
+   std::ostringstream out;
+   out << "{\"version\":" << version << ",\"data\":[";
+   for (int i = 0; i < 32; ++i)
+      out << (i ? "," : "") << version;
+   out << "]}";
+   return out.str();
+}
+
+// Readers check that every snapshot is one whole version and that versions never go back, while the calling thread 
+// publishes new versions until all readers are done
+void sharedCases()
+{
+   const int readers = 4;
+   const int reads   = 50000;
+
+   add("shared/read", []() {
+      cwjson::SharedDocument document;
+      document.publish(sharedVersion(1));
+
+      size_t sum = 0;
+      for (int i = 0; i < reads; ++i)
+         sum += document.read()->getType();
+      g_sink = (double)sum;
+      return Work(0, reads);
+   });
+
+   add("shared/read+publish", []() {
+      cwjson::SharedDocument document;
+      document.publish(sharedVersion(0));
+
+      std::atomic<int>         finished(0);
+      std::atomic<size_t>      failures(0);
+      std::vector<std::thread> threads;
+      for (int r = 0; r < readers; ++r)
+      {
+         threads.push_back(std::thread([&]() {
+            double last = 0;
+            for (int i = 0; i < reads; ++i)
+            {
+               cwjson::SharedDocument::Snapshot snapshot = document.read();
+               const cwjson::Object            &object   = snapshot->getObject();
+               double                           version  = object.getNumber("version").getValue();
+
+               if (version < last)
+                  failures++;
+               for (const cwjson::Value *it = object.getArray("data").firstChild(); it; it = it->nextSibling())
+               {
+                  if (it->toNumber().getValue() != version)
+                     failures++;
+               }
+               last = version;
+            }
+            finished++;
+         }));
+      }
+
+      for (int version = 1; finished < readers; ++version)
+         document.publish(sharedVersion(version));
+      for (size_t i = 0; i < threads.size(); ++i)
+         threads[i].join();
+      cwjson::Reclaimer::flush();
+
+      if (failures)
+      {
+         fprintf(stderr, "shared/read+publish: %u inconsistent snapshots\n", (unsigned)failures.load());
+         exit(1);
+      }
+      return Work(0, readers * reads);
+   });
+}
+
+// One thread parses, another deletes the trees, freed nodes have to find their way back to the parsing thread
+void poolCases()
+{
+   add("pool/handoff", []() {
+      const int   documents = 2000;
+      std::string text      = "[";
+      for (int i = 0; i < 200; ++i)
+         text += i ? ",{\"id\":1,\"ok\":true}" : "{\"id\":1,\"ok\":true}";
+      text += "]";
+
+      cwjson::BoundedQueue<cwjson::Root *> queue(8);
+      std::thread                          producer([&]() {
+         for (int i = 0; i < documents; ++i)
+         {
+            cwjson::Root *root = new cwjson::Root(text.c_str());
+            while (!queue.tryPush(root))
+               std::this_thread::yield();
+         }
+      });
+
+      cwjson::Root *root;
+      for (int i = 0; i < documents; ++i)
+      {
+         while (!queue.tryPop(root))
+            std::this_thread::yield();
+         delete root;
+      }
+      producer.join();
+      return Work(text.size() * documents, documents);
+   });
+}
+
+// Runs the pass until time is used up, reports the fastest pass
+void run(const Case &item, double seconds)
+{
+   typedef std::chrono::steady_clock Clock;
+
+   double      best   = 1e30;
+   double      total  = 0;
+   Work        work;
+   while (total < seconds)
+   {
+      if (item.prepare)
+         item.prepare();
+
+      Clock::time_point start = Clock::now();
+      work = item.pass();
+      double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+      best   = std::min(best, elapsed);
+      total += elapsed;
+   }
+
+   // cases without input text report per item time only
+   if (work.bytes)
+      printf("%-44s %10.1f MB/s", item.name.c_str(), work.bytes / best / (1 << 20));
+   else
+      printf("%-44s %15s", item.name.c_str(), "");
+   printf(" %10.2f ns/item\n", work.items ? best * 1e9 / work.items : 0.0);
+   fflush(stdout);
+}
+
+bool selected(const std::string &name, const std::vector<std::string> &prefixes)
+{
+   if (prefixes.empty())
+      return true;
+
+   for (const std::string &prefix : prefixes)
+   {
+      if (name.compare(0, prefix.size(), prefix) == 0)
+         return true;
+   }
+   return false;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+   bool                     list    = false;
+   double                   seconds = 0.5;
+   std::vector<std::string> prefixes;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+      if (arg == "--list")
+         list = true;
+      else if (arg == "--time" && i + 1 < argc)
+         seconds = atof(argv[++i]);
+      else if (arg[0] == '-')
+      {
+         std::cerr << "usage: cwjsonbench [--list] [--time seconds] [case-prefix...]" << std::endl;
+         return 1;
+      }
+      else
+         prefixes.push_back(arg);
+   }
+
+   whitespaceCases();
+   stringCases();
+   numberCases();
+   unicodeCases();
+   documentCases();
+   arrayCases();
+   sharedCases();
+   poolCases();
+
+   for (const Case &item : cases())
+   {
+      if (!selected(item.name, prefixes))
+         continue;
+
+      if (list)
+         printf("%s\n", item.name.c_str());
+      else
+         run(item, seconds);
+   }
+   return 0;
+}
@@ -25,6 +25,480 @@
 
 namespace cwjson {
 
+namespace {
+
+struct NodeBlock
+{
+   NodeBlock *next;
+};
+
+struct NodeCache
+{
+   NodeBlock *free[NodePool::Classes];
+   size_t     count[NodePool::Classes];
+   bool       active;
+   bool       disabled;
+};
+
+void freeBatch(NodeBlock *block)
+{
+   while (block)
+   {
+      NodeBlock *next = block->next;
+      ::operator delete(block);
+      block = next;
+   }
+}
+
+void trimCache(NodeCache *cache)
+{
+   for (size_t cls = 0; cls < NodePool::Classes; ++cls)
+   {
+      freeBatch(cache->free[cls]);
+      cache->free[cls]  = 0;
+      cache->count[cls] = 0;
+   }
+}
+
+#if CWJSON_THREADS
+
+thread_local NodeCache t_nodeCache;
+
+struct NodeCacheGuard
+{
+   ~NodeCacheGuard()
+   {
+      trimCache(&t_nodeCache);
+      t_nodeCache.active   = false;
+      t_nodeCache.disabled = true;
+   }
+};
+
+// Full batches of blocks moved between threads. A thread which only frees nodes parsed elsewhere hands them back 
+// here instead of growing its own list, a thread which only allocates takes them from here instead of the heap.
+struct NodeDepot
+{
+   std::mutex               lock;
+   std::vector<NodeBlock *> batches[NodePool::Classes];
+};
+
+NodeDepot &nodeDepot()
+{
+   // never destroyed, threads may still return blocks during static destruction
+   static NodeDepot *depot = new NodeDepot();
+   return *depot;
+}
+
+// Moves Batch blocks from the head of the thread's list to the depot
+void spillBatch(NodeCache *cache, size_t cls)
+{
+   NodeBlock *first = cache->free[cls];
+   NodeBlock *last  = first;
+   for (size_t i = 1; i < NodePool::Batch; ++i)
+      last = last->next;
+
+   cache->free[cls]   = last->next;
+   cache->count[cls] -= NodePool::Batch;
+   last->next         = 0;
+
+   NodeDepot &depot = nodeDepot();
+   {
+      std::lock_guard<std::mutex> lock(depot.lock);
+      if (depot.batches[cls].size() < NodePool::DepotLimit)
+      {
+         depot.batches[cls].push_back(first);
+         return;
+      }
+   }
+
+   freeBatch(first);
+}
+
+bool fillBatch(NodeCache *cache, size_t cls)
+{
+   NodeDepot                  &depot = nodeDepot();
+   std::lock_guard<std::mutex> lock(depot.lock);
+   if (depot.batches[cls].empty())
+      return false;
+
+   cache->free[cls]  = depot.batches[cls].back();
+   cache->count[cls] = NodePool::Batch;
+   depot.batches[cls].pop_back();
+   return true;
+}
+
+void trimDepot()
+{
+   NodeDepot                  &depot = nodeDepot();
+   std::lock_guard<std::mutex> lock(depot.lock);
+   for (size_t cls = 0; cls < NodePool::Classes; ++cls)
+   {
+      for (size_t i = 0; i < depot.batches[cls].size(); ++i)
+         freeBatch(depot.batches[cls][i]);
+      depot.batches[cls].clear();
+   }
+}
+
+NodeCache *nodeCache()
+{
+   NodeCache *cache = &t_nodeCache;
+   if (!cache->active)
+   {
+      if (cache->disabled)
+         return 0;
+
+      static thread_local NodeCacheGuard guard;
+      (void)guard;
+      cache->active = true;
+   }
+
+   return cache;
+}
+
+#else
+
+NodeCache *nodeCache()
+{
+   return 0;
+}
+
+void spillBatch(NodeCache *cache, size_t cls) {}
+bool fillBatch(NodeCache *cache, size_t cls) { return false; }
+void trimDepot() {}
+
+#endif
+
+size_t nodeClass(size_t size)
+{
+   return (size + NodePool::Granularity - 1) / NodePool::Granularity - 1;
+}
+
+const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct Base64Table
+{
+   Base64Table()
+   {
+      memset(decode, 0x80, sizeof(decode));
+      for (int i = 0; i < 64; ++i)
+         decode[(unsigned char)base64Chars[i]] = (unsigned char)i;
+   }
+
+   unsigned char decode[256];
+};
+
+const Base64Table base64Table;
+
+// 3 bytes to 4 characters, returns number of characters written
+size_t encodeBase64Block(char *out, const unsigned char *in, size_t size)
+{
+   char *start = out;
+   while (size >= 3)
+   {
+      unsigned int bits = (in[0] << 16) | (in[1] << 8) | in[2];
+      out[0] = base64Chars[bits >> 18];
+      out[1] = base64Chars[(bits >> 12) & 63];
+      out[2] = base64Chars[(bits >> 6) & 63];
+      out[3] = base64Chars[bits & 63];
+      in   += 3;
+      out  += 4;
+      size -= 3;
+   }
+
+   if (size)
+   {
+      unsigned int bits = (in[0] << 16) | (size > 1 ? in[1] << 8 : 0);
+      out[0] = base64Chars[bits >> 18];
+      out[1] = base64Chars[(bits >> 12) & 63];
+      out[2] = size > 1 ? base64Chars[(bits >> 6) & 63] : '=';
+      out[3] = '=';
+      out += 4;
+   }
+
+   return out - start;
+}
+
+}
+
+class KeyIndex
+{
+public:
+   KeyIndex() : m_count(0) {}
+
+   void clear()
+   {
+      m_count = 0;
+      m_table.clear();
+   }
+
+   Value **insert(Value *value)
+   {
+      const std::string &name = value->getNameStr();
+
+      if (m_table.empty())
+      {
+         for (size_t i = 0; i < m_count; ++i)
+         {
+            if (m_small[i]->getNameStr() == name)
+               return &m_small[i];
+         }
+
+         if (m_count < Small)
+         {
+            m_small[m_count++] = value;
+            return 0;
+         }
+
+         m_table.resize(Small * 4);
+         for (size_t i = 0; i < m_count; ++i)
+            *slot(m_small[i]->getNameStr()) = m_small[i];
+      }
+
+      Value **found = slot(name);
+      if (*found)
+         return found;
+
+      *found = value;
+      if (++m_count * 2 > m_table.size())
+         grow();
+      return 0;
+   }
+
+private:
+   enum { Small = 8 };
+
+   static size_t hash(const std::string &name)
+   {
+      size_t value = 2166136261u;
+      for (size_t i = 0; i < name.size(); ++i)
+         value = (value ^ (unsigned char)name[i]) * 16777619u;
+      return value;
+   }
+
+   Value **slot(const std::string &name)
+   {
+      size_t mask = m_table.size() - 1;
+      size_t pos  = hash(name) & mask;
+
+      while (m_table[pos] && m_table[pos]->getNameStr() != name)
+         pos = (pos + 1) & mask;
+
+      return &m_table[pos];
+   }
+
+   void grow()
+   {
+      std::vector<Value *> old(m_table.size() * 2, (Value *)0);
+      old.swap(m_table);
+
+      for (size_t i = 0; i < old.size(); ++i)
+      {
+         if (old[i])
+            *slot(old[i]->getNameStr()) = old[i];
+      }
+   }
+
+private:
+   Value               *m_small[Small];
+   size_t               m_count;
+   std::vector<Value *> m_table;
+};
+
+void *NodePool::allocate(size_t size)
+{
+   size_t     cls   = nodeClass(size);
+   NodeCache *cache = 0;
+
+   if (cls < Classes)
+   {
+      cache = nodeCache();
+      if (cache && (cache->free[cls] || fillBatch(cache, cls)))
+      {
+         NodeBlock *block = cache->free[cls];
+         cache->free[cls] = block->next;
+         cache->count[cls]--;
+         return block;
+      }
+
+      size = (cls + 1) * Granularity;
+   }
+
+   return ::operator new(size);
+}
+
+void NodePool::release(void *ptr, size_t size)
+{
+   if (!ptr)
+      return;
+
+   size_t cls = nodeClass(size);
+   if (cls < Classes)
+   {
+      NodeCache *cache = nodeCache();
+      if (cache)
+      {
+         NodeBlock *block = static_cast<NodeBlock *>(ptr);
+         block->next       = cache->free[cls];
+         cache->free[cls]  = block;
+         if (++cache->count[cls] > Limit)
+            spillBatch(cache, cls);
+         return;
+      }
+   }
+
+   ::operator delete(ptr);
+}
+
+void NodePool::reserve(size_t size, size_t count)
+{
+   size_t     cls   = nodeClass(size);
+   NodeCache *cache = nodeCache();
+
+   if (cls >= Classes || !cache)
+      return;
+
+   while (cache->count[cls] < count && cache->count[cls] < Limit)
+   {
+      NodeBlock *block = static_cast<NodeBlock *>(::operator new((cls + 1) * Granularity));
+      block->next       = cache->free[cls];
+      cache->free[cls]  = block;
+      cache->count[cls]++;
+   }
+}
+
+void NodePool::trim()
+{
+   NodeCache *cache = nodeCache();
+   if (!cache)
+      return;
+
+   trimCache(cache);
+   trimDepot();
+}
+
+#if CWJSON_THREADS
+
+namespace {
+
+class ReclaimerThread
+{
+public:
+   ReclaimerThread() : m_pending(0), m_shutdown(false) {}
+
+   ~ReclaimerThread()
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_lock);
+         m_shutdown = true;
+      }
+      m_wake.notify_all();
+
+      if (m_thread.joinable())
+         m_thread.join();
+   }
+
+   void release(Value *value)
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_lock);
+         if (!m_thread.joinable())
+            m_thread = std::thread(&ReclaimerThread::run, this);
+
+         m_queue.push_back(value);
+         m_pending++;
+      }
+      m_wake.notify_all();
+   }
+
+   void flush()
+   {
+      std::unique_lock<std::mutex> lock(m_lock);
+      m_done.wait(lock, [this]() { return m_pending == 0; });
+   }
+
+   size_t pending()
+   {
+      std::lock_guard<std::mutex> lock(m_lock);
+      return m_pending;
+   }
+
+private:
+   void run()
+   {
+      std::vector<Value *> batch;
+      while (1)
+      {
+         {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_wake.wait(lock, [this]() { return m_shutdown || !m_queue.empty(); });
+            if (m_queue.empty())
+               return;
+            batch.swap(m_queue);
+         }
+
+         for (size_t i = 0; i < batch.size(); ++i)
+            delete batch[i];
+
+         {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_pending -= batch.size();
+         }
+         m_done.notify_all();
+         batch.clear();
+      }
+   }
+
+private:
+   std::mutex              m_lock;
+   std::condition_variable m_wake;
+   std::condition_variable m_done;
+   std::vector<Value *>    m_queue;
+   size_t                  m_pending;
+   bool                    m_shutdown;
+   std::thread             m_thread;
+};
+
+ReclaimerThread &reclaimer()
+{
+   static ReclaimerThread instance;
+   return instance;
+}
+
+}
+
+void Reclaimer::release(Value *value)
+{
+   if (value)
+      reclaimer().release(value);
+}
+
+void Reclaimer::flush()
+{
+   reclaimer().flush();
+}
+
+size_t Reclaimer::pending()
+{
+   return reclaimer().pending();
+}
+
+#else
+
+void Reclaimer::release(Value *value)
+{
+   delete value;
+}
+
+void Reclaimer::flush()
+{
+}
+
+size_t Reclaimer::pending()
+{
+   return 0;
+}
+
+#endif
 
 void Value::insertValueInt(Value *value)
 {
@@ -99,8 +573,68 @@ bool Value::isNull() const
    return getType() == TypeNull; 
 }
 
+Value *Value::detach()
+{
+   if (!m_parent)
+      return this;
+
+   m_parent->removeValueInt(this);
+   if (m_parent->getType() == TypeObject)
+      static_cast<Object *>(m_parent)->lookupReplace(this, 0);
+
+   m_parent = m_prev = m_next = 0;
+   return this;
+}
+
+namespace {
+void checkMove(const Value &target, const Value &source)
+{
+   for (const Value *it = &target; it; it = it->parent())
+   {
+      if (it == &source)
+         throw JsonError("can't move values into their own subtree");
+   }
+}
+}
+
+Value &Object::getValue(const char *name)
+{
+   if (!m_lookup)
+      return const_cast<Value &>(static_cast<const Object *>(this)->getValue(name));
+
+   // Only non-const access reorders the lookup, const access stays a pure read
+   std::vector<Value *> &lookup = *m_lookup;
+   for (size_t i = 0; i < lookup.size(); ++i)
+   {
+      Value *value = lookup[i];
+      if (value->getNameStr() == name)
+      {
+         if (i)
+         {
+            memmove(&lookup[1], &lookup[0], i * sizeof(Value *));
+            lookup[0] = value;
+         }
+         return *value;
+      }
+   }
+
+   throw JsonNull(std::string("value not found: ") + name);
+}
+
 const Value &Object::getValue(const char *name) const
 {
+   if (m_lookup)
+   {
+      const std::vector<Value *> &lookup = *m_lookup;
+      for (size_t i = 0; i < lookup.size(); ++i)
+      {
+         if (lookup[i]->getNameStr() == name)
+            return *lookup[i];
+      }
+
+      throw JsonNull(std::string("value not found: ") + name);
+   }
+
    Value *it = m_firstChild;
    while (it)
    {
@@ -118,7 +652,7 @@ Value *Object::linkValue(const char *name, Value *value)
       return 0;
 
    if (value->m_next || value->m_parent || value->m_prev)
-      JsonError("value is already linked to JSON object");
+      throw JsonError("value is already linked to JSON object");
 
    Value *it = m_firstChild;
    while (it)
@@ -126,7 +660,9 @@ Value *Object::linkValue(const char *name, Value *value)
       if (it->getNameStr() == name)
       {
          value->setName(name);
-         delete it->swapValueInt(value);
+         it->swapValueInt(value);
+         lookupReplace(it, value);
+         delete it;
          return value;
       }
       it = it->m_next;
@@ -134,6 +670,7 @@ Value *Object::linkValue(const char *name, Value *value)
 
    value->setName(name);
    insertValueInt(value);
+   lookupReplace(0, value);
    return value;
 }
 
@@ -158,40 +695,136 @@ void Object::removeValue(const char *name)
    {
       if (it->getNameStr() == name)
       {
-         delete removeValueInt(it);
+         removeValueInt(it);
+         lookupReplace(it, 0);
+         delete it;
          return;
       }
       it = it->m_next;
    }
 }
 
-Object &Object::createObject(const char *name) 
+void Object::setAdaptiveLookup(bool enable)
 {
-   Object *newo = new Object();
-   linkValueSafe(name, newo); 
-   return *newo;
-}
+   if (!enable)
+   {
+      delete m_lookup;
+      m_lookup = 0;
+      return;
+   }
 
-Array &Object::createArray(const char *name) 
-{
-   Array *newa = new Array();
-   linkValueSafe(name, newa); 
-   return *newa;
-}
+   if (m_lookup)
+      return;
 
-Object *Object::clone() const
-{
-   std::auto_ptr<Object> ptr(new Object());
+   std::auto_ptr< std::vector<Value *> > lookup(new std::vector<Value *>());
+   lookup->reserve(m_length);
+
+   Value *it = m_firstChild;
+   while (it)
+   {
+      lookup->push_back(it);
+      it = it->m_next;
+   }
+
+   m_lookup = lookup.release();
+}
+
+void Object::lookupReplace(Value *oldValue, Value *newValue)
+{
+   if (!m_lookup)
+      return;
+
+   if (!oldValue)
+   {
+      m_lookup->push_back(newValue);
+      return;
+   }
+
+   std::vector<Value *>::iterator it = std::find(m_lookup->begin(), m_lookup->end(), oldValue);
+   if (it == m_lookup->end())
+      return;
+
+   if (newValue)
+      *it = newValue;
+   else
+      m_lookup->erase(it);
+}
+
+void Object::moveMembersFrom(Object &other, bool replace)
+{
+   checkMove(*this, other);
+
+   // name index over current members, so replacing is O(n + k) instead of a scan per moved member
+   KeyIndex index;
+   if (replace && other.m_firstChild)
+   {
+      for (Value *member = m_firstChild; member; member = member->m_next)
+         index.insert(member);
+   }
+
+   Value *it = other.m_firstChild;
+   while (it)
+   {
+      Value *next = it->m_next;
+      it->m_prev = it->m_next = 0;
+
+      // first member with the name, moved members are added to the index as they are appended
+      Value **found = replace ? index.insert(it) : 0;
+      Value  *old   = found ? *found : 0;
+
+      if (old)
+      {
+         old->swapValueInt(it);
+         lookupReplace(old, it);
+         *found = it;
+         delete old;
+      }
+      else
+      {
+         insertValueInt(it);
+         lookupReplace(0, it);
+      }
+
+      it = next;
+   }
+
+   other.m_firstChild = other.m_lastChild = 0;
+   other.m_length     = 0;
+   if (other.m_lookup)
+      other.m_lookup->clear();
+}
+
+Object &Object::createObject(const char *name) 
+{
+   Object *newo = new Object();
+   linkValueSafe(name, newo); 
+   return *newo;
+}
+
+Array &Object::createArray(const char *name) 
+{
+   Array *newa = new Array();
+   linkValueSafe(name, newa); 
+   return *newa;
+}
+
+Object *Object::clone() const
+{
+   std::auto_ptr<Object> ptr(new Object());
 
    Value *it = m_firstChild;
    while (it)
    {
       Value *copy = it->clone();
-      copy->setName(it->m_name);
+      copy->m_name       = it->m_name;
+      copy->m_nameEscape = it->m_nameEscape;
       ptr->insertValueInt(copy);
       it = it->m_next;
    }
 
+   if (m_lookup)
+      ptr->setAdaptiveLookup(true);
+
    return ptr.release();
 }
 
@@ -215,7 +848,7 @@ Value *Array::linkValueInt(Value *value, int position, int where)
       return 0;
 
    if (value->m_next || value->m_parent || value->m_prev)
-      JsonError("value is already linked to JSON object");
+      throw JsonError("value is already linked to JSON object");
 
    if (0 == where)
       insertValueInt(value);      
@@ -271,6 +904,68 @@ void Array::removeValue(int position)
    throw JsonNull(std::string("index out of range"));
 }
 
+void Array::spliceBack(Array &other)
+{
+   if (!other.m_firstChild)
+      return;
+
+   checkMove(*this, other);
+
+   for (Value *it = other.m_firstChild; it; it = it->m_next)
+      it->m_parent = this;
+
+   if (m_lastChild)
+   {
+      m_lastChild->m_next        = other.m_firstChild;
+      other.m_firstChild->m_prev  = m_lastChild;
+   }
+   else
+      m_firstChild = other.m_firstChild;
+
+   m_lastChild = other.m_lastChild;
+   m_length   += other.m_length;
+
+   other.m_firstChild = other.m_lastChild = 0;
+   other.m_length     = 0;
+}
+
+void Array::reverse()
+{
+   Value *it = m_firstChild;
+   while (it)
+   {
+      Value *next = it->m_next;
+      it->m_next  = it->m_prev;
+      it->m_prev  = next;
+      it          = next;
+   }
+
+   std::swap(m_firstChild, m_lastChild);
+}
+
+void Array::appendChain(Value *chain)
+{
+   while (chain)
+   {
+      Value *next   = chain->m_next;
+      chain->m_prev = chain->m_next = 0;
+      insertValueInt(chain);
+      chain = next;
+   }
+}
+
+void Array::relinkValues(const std::vector<Value *> &values)
+{
+   for (size_t i = 0; i < values.size(); ++i)
+   {
+      values[i]->m_prev = i ? values[i - 1] : 0;
+      values[i]->m_next = i + 1 < values.size() ? values[i + 1] : 0;
+   }
+
+   m_firstChild = values.front();
+   m_lastChild  = values.back();
+}
+
 Array *Array::clone() const
 {
    std::auto_ptr<Array> ptr(new Array());
@@ -301,154 +996,333 @@ void Root::parse(const char *json)
    if (!json)
       return;
 
+   IncrementalParser parser(*this, json);
+   parser.step((size_t)-1);
+}
+
+void Root::parse(const char *json, size_t length)
+{
+   if (!json)
+      return;
+
+   IncrementalParser parser(*this, json, length);
+   parser.step((size_t)-1);
+}
+
+void Root::clear()
+{
    if (m_firstChild)
       delete m_firstChild;
-   m_firstChild = 0;
-
-   std::string empty;
-   parse_value(this, empty, json);
+   m_firstChild = m_lastChild = 0;
+   m_length     = 0;
 }
 
-const char *Root::parse_value(Value *parent, std::string &name, const char *ptr)
+void Root::releaseAsync()
 {
-   ptr = whitespace(ptr);
+   Value *value = m_firstChild;
+   m_firstChild = m_lastChild = 0;
+   m_length     = 0;
 
-   switch (*ptr)
+   if (value)
    {
-   case '{':
-      {
-         ptr = skip(ptr, 1);
+      value->m_parent = 0;
+      Reclaimer::release(value);
+   }
+}
 
-         Object *object = new Object(name);
-         parent->insertValueInt(object);
+namespace {
 
-         ptr = whitespace(ptr);
-         if (*ptr == '}')
-            return skip(ptr, 1);
+// transcoders and scanners test one size_t worth of bytes at a time, it exists in C++98 and fits a register
+const size_t wordSize = sizeof(size_t);
 
-         while (1)
-         {
-            std::string valueName;
-            ptr = whitespace(ptr);
-            ptr = parse_string(valueName, ptr);
+// byte masks of UTF-16 code units below 0x80, built from bytes so they don't depend on host byte order
+const unsigned char asciiMaskLE[8] = { 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF };
+const unsigned char asciiMaskBE[8] = { 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80 };
+const unsigned char lowByteLE[8]   = { 0x80, 0x00, 0x80, 0x00, 0x80, 0x00, 0x80, 0x00 };
+const unsigned char lowByteBE[8]   = { 0x00, 0x80, 0x00, 0x80, 0x00, 0x80, 0x00, 0x80 };
 
-            ptr = whitespace(ptr);
-            if (*ptr != ':')
-               throw JsonError("expected ':' before object value");
-            ptr = skip(ptr, 1);
+unsigned int utf16Unit(const unsigned char *ptr, bool bigEndian)
+{
+   return bigEndian ? (ptr[0] << 8) | ptr[1] : (ptr[1] << 8) | ptr[0];
+}
 
-            ptr = parse_value(object, valueName, ptr);
-            ptr = whitespace(ptr);
+void putUtf16Unit(char *ptr, unsigned int unit, bool bigEndian)
+{
+   ptr[bigEndian ? 0 : 1] = (char)(unit >> 8);
+   ptr[bigEndian ? 1 : 0] = (char)(unit & 0xFF);
+}
 
-            if (*ptr == ',')
-            {
-               ptr = skip(ptr, 1);
-               continue;
-            }
+// Appends UTF-16 units (size is even) to out as UTF-8, output goes through a small buffer so short string runs
+// don't pay for resizing the string
+void transcodeUtf16(std::string &out, const char *data, size_t size, bool bigEndian)
+{
+   size_t mask;
+   memcpy(&mask, bigEndian ? asciiMaskBE : asciiMaskLE, wordSize);
 
-            if (*ptr == '}')
-               break;
+   const unsigned char *in   = (const unsigned char *)data;
+   const unsigned char *end  = in + size;
+   int                  low  = bigEndian ? 1 : 0;
+   char                 buffer[512];
+   char                *dst  = buffer;
+
+   while (in < end)
+   {
+      // room for the longest step, four ASCII units or a surrogate pair
+      if (dst > buffer + sizeof(buffer) - 4)
+      {
+         out.append(buffer, dst - buffer);
+         dst = buffer;
+      }
 
-            throw JsonError("expected '}' or ',' after object element");
+      // a word of ASCII units at once
+      if ((size_t)(end - in) >= wordSize)
+      {
+         size_t word;
+         memcpy(&word, in, wordSize);
+         if (!(word & mask))
+         {
+            for (size_t i = 0; i < wordSize / 2; ++i)
+               dst[i] = (char)in[low + i * 2];
+            dst += wordSize / 2;
+            in  += wordSize;
+            continue;
          }
+      }
+
+      unsigned int unit = utf16Unit(in, bigEndian);
+      in += 2;
 
-         return skip(ptr, 1);
+      if (unit < 0x80)
+         *dst++ = (char)unit;
+      else if (unit < 0x800)
+      {
+         *dst++ = (char)(0xC0 | (unit >> 6));
+         *dst++ = (char)(0x80 | (unit & 0x3F));
       }
-      break;
-   case '[':
+      else if (unit < 0xD800 || unit > 0xDFFF)
       {
-         ptr = skip(ptr, 1);
+         *dst++ = (char)(0xE0 | (unit >> 12));
+         *dst++ = (char)(0x80 | ((unit >> 6) & 0x3F));
+         *dst++ = (char)(0x80 | (unit & 0x3F));
+      }
+      else
+      {
+         if (unit > 0xDBFF || end - in < 2)
+            throw JsonError("bad utf-16 surrogate");
+
+         unsigned int second = utf16Unit(in, bigEndian);
+         if (second < 0xDC00 || second > 0xDFFF)
+            throw JsonError("bad utf-16 surrogate");
+         in += 2;
+
+         unsigned int code = 0x10000 + ((unit - 0xD800) << 10) + (second - 0xDC00);
+         *dst++ = (char)(0xF0 | (code >> 18));
+         *dst++ = (char)(0x80 | ((code >> 12) & 0x3F));
+         *dst++ = (char)(0x80 | ((code >> 6) & 0x3F));
+         *dst++ = (char)(0x80 | (code & 0x3F));
+      }
+   }
 
-         Array *array = new Array(name);
-         parent->insertValueInt(array);
+   out.append(buffer, dst - buffer);
+}
 
-         ptr = whitespace(ptr);
-         if (*ptr == ']')
-            return skip(ptr, 1);
+// Appends UTF-8 text to out as UTF-16, overlong forms, surrogates and values above U+10FFFF are rejected
+void transcodeUtf8(std::string &out, const char *data, size_t size, bool bigEndian)
+{
+   static const unsigned int shortest[5] = { 0, 0, 0x80, 0x800, 0x10000 };
 
-         while (1)
-         {
-            std::string empty;
+   if (!size)
+      return;
 
-            ptr = parse_value(array, empty, ptr);
-            ptr = whitespace(ptr);
+   // each UTF-8 byte produces at most one UTF-16 unit
+   size_t used = out.size();
+   out.resize(used + size * 2);
 
-            if (*ptr == ',')
-            {
-               ptr = skip(ptr, 1);
-               continue;
-            }
+   const unsigned char *in  = (const unsigned char *)data;
+   const unsigned char *end = in + size;
+   char                *dst = &out[used];
+   int                  low = bigEndian ? 1 : 0;
 
-            if (*ptr == ']')
-               break;
-            
-            throw JsonError("expected ']' or ',' after array element");
+   while (in < end)
+   {
+      // a word of ASCII bytes at once
+      if ((size_t)(end - in) >= wordSize)
+      {
+         size_t word;
+         memcpy(&word, in, wordSize);
+         if (!(word & ((size_t)-1 / 255 * 0x80)))
+         {
+            memset(dst, 0, wordSize * 2);
+            for (size_t i = 0; i < wordSize; ++i)
+               dst[i * 2 + low] = (char)in[i];
+            dst += wordSize * 2;
+            in  += wordSize;
+            continue;
          }
+      }
 
-         return skip(ptr, 1);
+      unsigned int code   = *in;
+      int          length = 0;
+
+      if (code < 0x80)
+         length = 1;
+      else if ((code & 0xE0) == 0xC0)
+      {
+         code   = code & 0x1F;
+         length = 2;
       }
-      break;
-   case '\"':
+      else if ((code & 0xF0) == 0xE0)
       {
-         std::string string;
-         ptr = parse_string(string, ptr);
-         parent->insertValueInt(new String(name, string));
-         return ptr;
+         code   = code & 0x0F;
+         length = 3;
       }
-      break;
-   case 't':
+      else if ((code & 0xF8) == 0xF0)
       {
-         if (strncmp(ptr, "true", 4) == 0)
-         {
-            parent->insertValueInt(new Boolean(name, true));
-            return skip(ptr, 4);
-         }
+         code   = code & 0x07;
+         length = 4;
       }
-      break;
-   case 'f':
+
+      if (!length || end - in < length)
+         throw JsonError("bad utf-8 sequence");
+
+      for (int i = 1; i < length; ++i)
       {
-         if (strncmp(ptr, "false", 5) == 0)
-         {
-            parent->insertValueInt(new Boolean(name, false));
-            return skip(ptr, 5);
-         }
+         if ((in[i] & 0xC0) != 0x80)
+            throw JsonError("bad utf-8 sequence");
+         code = (code << 6) | (in[i] & 0x3F);
       }
-      break;
-   case 'n':
+      in += length;
+
+      if (code < shortest[length] || (code >= 0xD800 && code <= 0xDFFF) || code > 0x10FFFF)
+         throw JsonError("bad utf-8 sequence");
+
+      if (code < 0x10000)
       {
-         if (strncmp(ptr, "null", 4) == 0)
-         {
-            parent->insertValueInt(new Null(name));
-            return skip(ptr, 4);
-         }
+         putUtf16Unit(dst, code, bigEndian);
+         dst += 2;
       }
-      break;
-   case '-':
-   case '0':
-   case '1':
-   case '2':
-   case '3':
-   case '4':
-   case '5':
-   case '6':
-   case '7':
-   case '8':
-   case '9':
+      else
       {
-         double number;
-         ptr = parse_number(number, ptr);
-         parent->insertValueInt(new Number(name, number));
-         return ptr;
+         code -= 0x10000;
+         putUtf16Unit(dst, 0xD800 + (code >> 10), bigEndian);
+         putUtf16Unit(dst + 2, 0xDC00 + (code & 0x3FF), bigEndian);
+         dst += 4;
       }
-      break;
-   default:
-      break;
    }
 
-   throw JsonError("unexpected character");
+   out.resize(dst - &out[0]);
+}
+
+// Parser input policies. at() returns ASCII character at ptr or 0 at the end of input, next() moves by count
+// characters, append() adds raw string characters to the decoded value. The scanners below are instantiated
+// for each policy, zero terminated text compiles to the same code as plain pointer access. Inputs with a length
+// are strict: a string cut off by the end and data after the value are errors, zero terminated text keeps the
+// old lenient behaviour.
+
+struct TextInput
+{
+   enum { Wide = 0, Strict = 0 };
+
+   bool        atEnd(const char *ptr) const { return !*ptr; }
+   char        at(const char *ptr) const { return *ptr; }
+   const char *next(const char *ptr, size_t count) const { return ptr + count; }
+   const char *plain(const char *ptr) const { return ptr; }
+   bool        match(const char *ptr, const char *word, size_t length) const { return strncmp(ptr, word, length) == 0; }
+   void        append(std::string &value, const char *start, const char *stop) const { value.append(start, stop - start); }
+};
+
+struct BoundedInput
+{
+   enum { Wide = 0, Strict = 1 };
+
+   BoundedInput(const char *end) : end(end) {}
+
+   bool        atEnd(const char *ptr) const { return ptr >= end; }
+   char        at(const char *ptr) const { return ptr < end ? *ptr : 0; }
+   const char *next(const char *ptr, size_t count) const { return ptr + count; }
+   const char *plain(const char *ptr) const { return ptr; }
+   void        append(std::string &value, const char *start, const char *stop) const { value.append(start, stop - start); }
+
+   bool match(const char *ptr, const char *word, size_t length) const
+   {
+      return (size_t)(end - ptr) >= length && memcmp(ptr, word, length) == 0;
+   }
+
+   const char *end;
+};
+
+// Code units are read in place, units above 0x7F are reported as 0xFF and only string contents are transcoded
+template <bool BigEndian> struct Utf16Input
+{
+   enum { Wide = 1, Strict = 1 };
+
+   Utf16Input(const char *end) : end(end) {}
+
+   bool        atEnd(const char *ptr) const { return end - ptr < 2; }
+   const char *next(const char *ptr, size_t count) const { return ptr + count * 2; }
+   void        append(std::string &value, const char *start, const char *stop) const { transcodeUtf16(value, start, stop - start, BigEndian); }
+
+   char at(const char *ptr) const
+   {
+      if (end - ptr < 2)
+         return 0;
+
+      unsigned int unit = utf16Unit((const unsigned char *)ptr, BigEndian);
+      return unit < 0x80 ? (char)unit : (char)0xFF;
+   }
+
+   // skips string characters a word at a time while no low byte can be '"', '\\' or control character
+   const char *plain(const char *ptr) const
+   {
+      const size_t ones = (size_t)-1 / 255;
+      const size_t high = ones * 0x80;
+
+      size_t low;
+      memcpy(&low, BigEndian ? lowByteBE : lowByteLE, wordSize);
+
+      while ((size_t)(end - ptr) >= wordSize)
+      {
+         size_t word;
+         memcpy(&word, ptr, wordSize);
+
+         size_t quote = word ^ (ones * '\"');
+         size_t slash = word ^ (ones * '\\');
+         size_t flags = ((word - ones * 0x20) & ~word) | ((quote - ones) & ~quote) | ((slash - ones) & ~slash);
+         if (flags & high & low)
+            break;
+         ptr += wordSize;
+      }
+      return ptr;
+   }
+
+   bool match(const char *ptr, const char *word, size_t length) const
+   {
+      if ((size_t)(end - ptr) < length * 2)
+         return false;
+
+      for (size_t i = 0; i < length; ++i)
+      {
+         if (utf16Unit((const unsigned char *)ptr + i * 2, BigEndian) != (unsigned char)word[i])
+            return false;
+      }
+      return true;
+   }
+
+   const char *end;
+};
+
+template <class Input> const char *scanWhitespace(const char *ptr, const Input &input)
+{
+   char c = input.at(ptr);
+   while (c == 0x20 || c == 0x09 || c == 0x0A || c == 0x0D)
+   {
+      ptr = input.next(ptr, 1);
+      c   = input.at(ptr);
+   }
+   return ptr;
 }
 
-const char *Root::parse_number(double &value, const char *ptr)
+template <class Input> const char *scanNumber(double &value, const char *ptr, const Input &input)
 {
    double      number = 0;
    double      sign = 1;
@@ -456,59 +1330,59 @@ const char *Root::parse_number(double &value, const char *ptr)
    int         expSign = 1;
    int         exp = 0;
 
-   if (*ptr == '-')
+   if (input.at(ptr) == '-')
    {
       sign = -1;
-      ptr = skip(ptr, 1);
+      ptr = input.next(ptr, 1);
    }
 
-   if (*ptr == '0')
+   if (input.at(ptr) == '0')
    {
-      ptr = skip(ptr, 1);
-      if (isDigit(*ptr))
+      ptr = input.next(ptr, 1);
+      if (Scanner::isDigit(input.at(ptr)))
          throw JsonError("leading zeros are not allowed");
    }
-   else if (isDigit(*ptr))
+   else if (Scanner::isDigit(input.at(ptr)))
    {
-      while (isDigit(*ptr))
+      while (Scanner::isDigit(input.at(ptr)))
       {
-         number = number * 10.0 + (*ptr - '0');
-         ptr = skip(ptr, 1);
+         number = number * 10.0 + (input.at(ptr) - '0');
+         ptr = input.next(ptr, 1);
       }
    }
 
-   if (*ptr == '.')
+   if (input.at(ptr) == '.')
    {
-      ptr = skip(ptr, 1);
-      if (!isDigit(*ptr))
+      ptr = input.next(ptr, 1);
+      if (!Scanner::isDigit(input.at(ptr)))
          throw JsonError("expected digit after '.'");
 
-      while (isDigit(*ptr))
+      while (Scanner::isDigit(input.at(ptr)))
       {
-         number = number * 10.0 + (*ptr - '0');
+         number = number * 10.0 + (input.at(ptr) - '0');
          frac  += 1;
-         ptr = skip(ptr, 1);
+         ptr = input.next(ptr, 1);
       }
    }
 
-   if (*ptr == 'e' || *ptr == 'E')
+   if (input.at(ptr) == 'e' || input.at(ptr) == 'E')
    {
-      ptr = skip(ptr, 1);
-      if (*ptr == '-')
+      ptr = input.next(ptr, 1);
+      if (input.at(ptr) == '-')
       {
          expSign = -1;
-         ptr = skip(ptr, 1);
+         ptr = input.next(ptr, 1);
       } 
-      else if (*ptr == '+')
-         ptr = skip(ptr, 1);
+      else if (input.at(ptr) == '+')
+         ptr = input.next(ptr, 1);
 
-      if (!isDigit(*ptr))
+      if (!Scanner::isDigit(input.at(ptr)))
          throw JsonError("expected digit after 'e' or 'E'");
 
-      while (isDigit(*ptr))
+      while (Scanner::isDigit(input.at(ptr)))
       {
-         exp = exp * 10 + (*ptr - '0');
-         ptr = skip(ptr, 1);
+         exp = exp * 10 + (input.at(ptr) - '0');
+         ptr = input.next(ptr, 1);
       }
    }
 
@@ -540,308 +1414,3454 @@ const char *Root::parse_number(double &value, const char *ptr)
    return ptr;
 }
 
-const char *Root::parse_string(std::string &value, const char *ptr)
+template <class Input> const char *scanUnicode(int &value, const char *ptr, const Input &input)
 {
-   value = "";
-   ptr = skip(ptr, 1);
-
-   if (*ptr == '\"')
-      return skip(ptr, 1);
-
-   const char *start = ptr; 
+   value = 0;
 
-   while (*ptr != '\"' && *ptr)
+   for (int i = 0; i < 4; ++i)
    {
-      if (*ptr != '\\')
-         ptr = skip(ptr, 1);
+      char hex = input.at(ptr);
+
+      if ((hex >= '0' && hex <= '9'))
+         value = (value << 4) + (hex - '0');
+      else if ((hex >= 'a' && hex <= 'f'))
+         value = (value << 4) + (hex - 'a' + 10);
+      else if ((hex >= 'A' && hex <= 'F'))
+         value = (value << 4) + (hex - 'A' + 10);
       else
-      {
-         if (ptr != start)
-            value.append(start, ptr - start);
+         throw JsonError("bad escaped character");
 
-         ptr = skip(ptr, 1);
+      ptr = input.next(ptr, 1);
+   }
+
+   return ptr;
+}
+
+template <class Input> const char *scanEscape(char *value, size_t &length, const char *ptr, const Input &input)
+{
+   length = 1;
+
+   char c = input.at(ptr);
+   switch (c)
+   {
+   case 'b':
+      value[0] = '\b';
+      break;
+   case 'f':
+      value[0] = '\f';
+      break;
+   case 'n':
+      value[0] = '\n';
+      break;
+   case 'r':
+      value[0] = '\r';
+      break;
+   case 't':
+      value[0] = '\t';
+      break;
+   case 'u':
+      {
+         ptr = input.next(ptr, 1);
+
+         int unicode;
+         ptr = scanUnicode(unicode, ptr, input);
+
+         if ((unicode >= 0xDC00 && unicode <= 0xDFFF) || unicode == 0)	
+            throw JsonError("bad unicode character");
+
+         if (unicode >= 0xD800 && unicode <= 0xDBFF )
+         {
+            if (input.at(ptr) != '\\')
+               throw JsonError("expected second unicode surrogate part");
+            ptr = input.next(ptr, 1);
+            if (input.at(ptr) != 'u')
+               throw JsonError("expected second unicode surrogate part");
+            ptr = input.next(ptr, 1);
+
+            int unicode2;
+            ptr = scanUnicode(unicode2, ptr, input);
+
+            unicode = 0x10000 + (((unicode & 0x3FF) << 10) | (unicode2 & 0x3FF));
+         }
+
+         if (unicode < 0x80)
+         {
+            length = 1;
+            value[0] = (char)unicode;
+         }
+         else if (unicode < 0x800)
+         {
+            length = 2;
+            value[0] = (char)(0xc0 | (unicode >> 6));
+         }
+         else if (unicode < 0x10000)
+         {
+            length = 3;
+            value[0] = (char)(0xe0 | (unicode >> 12));
+         }
+         else
+         {
+            length = 4;
+            value[0] = (char)(0xf0 | (unicode >> 18));
+         }
+
+         for (size_t i = 1; i < length; ++i)
+         {
+            int shift = (int)(length - i - 1) * 6;
+            value[i] = (char)(0x80 | ((unicode >> shift) & 0x3f));
+         }
+      }
+      return ptr;
+   case 0:
+      length = 0;
+      return ptr;
+   default:
+      // escaped non-ASCII UTF-16 character is left in place for the string run to transcode
+      if (Input::Wide && (unsigned char)c >= 0x80)
+      {
+         length = 0;
+         return ptr;
+      }
+      value[0] = c;
+      break;
+   }
+
+   return input.next(ptr, 1);
+}
+
+template <class Input> const char *scanString(std::string &value, bool &escape, const char *ptr, const Input &input)
+{
+   value  = "";
+   escape = false;
+   ptr    = input.next(ptr, 1);
+
+   if (input.at(ptr) == '\"')
+      return input.next(ptr, 1);
+
+   const char *start = ptr; 
+
+   // "escape" is set if printer will have to escape decoded string
+   char c;
+   while ((c = input.at(ptr)) != '\"' && c)
+   {
+      if (c != '\\')
+      {
+         if ((unsigned char)c < 32)
+            escape = true;
+         ptr = input.plain(input.next(ptr, 1));
+      }
+      else
+      {
+         if (ptr != start)
+            input.append(value, start, ptr);
+
+         char   decoded[4];
+         size_t len;
+         ptr = scanEscape(decoded, len, input.next(ptr, 1), input);
+         value.append(decoded, len);
+
+         if (len == 1 && ((unsigned char)decoded[0] < 32 || decoded[0] == '\"' || decoded[0] == '\\'))
+            escape = true;
+
+         start = ptr;
+      }
+   }
+
+   if (ptr != start)
+      input.append(value, start, ptr);
+
+   if (0 == c)
+   {
+      if (Input::Strict)
+         throw JsonError("unterminated string");
+      return ptr;
+   }
+
+   return input.next(ptr, 1);
+}
+
+}
+
+IncrementalParser::IncrementalParser(Root &root, const char *json) : 
+   m_root(root), 
+   m_start(json), 
+   m_ptr(json), 
+   m_end(0),
+   m_encoding(EncodingUtf8),
+   m_state(json ? StateValue : StateDone), 
+   m_duplicates(root.getDuplicateMode()),
+   m_nameEscape(false)
+{
+   m_root.clear();
+}
+
+IncrementalParser::IncrementalParser(Root &root, const char *data, size_t size, Encoding encoding) : 
+   m_root(root), 
+   m_start(data), 
+   m_ptr(data), 
+   m_end(data + size),
+   m_encoding(encoding),
+   m_state(data ? StateValue : StateDone), 
+   m_duplicates(root.getDuplicateMode()),
+   m_nameEscape(false)
+{
+   m_root.clear();
+}
+
+IncrementalParser::~IncrementalParser()
+{
+   for (size_t i = 0; i < m_keys.size(); ++i)
+      delete m_keys[i];
+}
+
+bool IncrementalParser::step(size_t budget)
+{
+   if (!m_end)
+      return run(budget, TextInput());
+
+   switch (m_encoding)
+   {
+   case EncodingUtf16LE:
+      return run(budget, Utf16Input<false>(m_end));
+   case EncodingUtf16BE:
+      return run(budget, Utf16Input<true>(m_end));
+   default:
+      return run(budget, BoundedInput(m_end));
+   }
+}
+
+template <class Input> bool IncrementalParser::run(size_t budget, const Input &input)
+{
+   const char *ptr = m_ptr;
+
+   while (m_state != StateDone && (size_t)(ptr - m_ptr) < budget)
+   {
+      switch (m_state)
+      {
+      case StateValue:
+         ptr = parseValue(ptr, input);
+         break;
+      case StateKey:
+         ptr = parseKey(ptr, input);
+         break;
+      case StateNext:
+         ptr = parseNext(ptr, input);
+         break;
+      default:
+         break;
+      }
+   }
+
+   m_ptr = ptr;
+   return m_state == StateDone;
+}
+
+void IncrementalParser::link(Value *parent, Value *value)
+{
+   value->m_nameEscape = m_nameEscape;
+   m_nameEscape        = false;
+   parent->insertValueInt(value);
+}
+
+void IncrementalParser::push(Value *container)
+{
+   m_stack.push_back(container);
+
+   if (m_duplicates != DuplicateKeep && container->getType() == TypeObject)
+   {
+      size_t depth = m_stack.size() - 1;
+      if (m_keys.size() <= depth)
+         m_keys.resize(depth + 1, (KeyIndex *)0);
+
+      if (m_keys[depth])
+         m_keys[depth]->clear();
+      else
+         m_keys[depth] = new KeyIndex();
+   }
+}
+
+template <class Input> const char *IncrementalParser::parseValue(const char *ptr, const Input &input)
+{
+   Value *parent = m_stack.empty() ? &m_root : m_stack.back();
+
+   ptr = scanWhitespace(ptr, input);
+
+   switch (input.at(ptr))
+   {
+   case '{':
+      {
+         ptr = input.next(ptr, 1);
+
+         Object *object = new Object(m_name);
+         link(parent, object);
+
+         ptr = scanWhitespace(ptr, input);
+         if (input.at(ptr) == '}')
+         {
+            m_state = StateNext;
+            return input.next(ptr, 1);
+         }
+
+         push(object);
+         m_state = StateKey;
+         return ptr;
+      }
+      break;
+   case '[':
+      {
+         ptr = input.next(ptr, 1);
+
+         Array *array = new Array(m_name);
+         link(parent, array);
+
+         ptr = scanWhitespace(ptr, input);
+         if (input.at(ptr) == ']')
+         {
+            m_state = StateNext;
+            return input.next(ptr, 1);
+         }
+
+         push(array);
+         m_state = StateValue;
+         return ptr;
+      }
+      break;
+   case '\"':
+      {
+         std::string string;
+         bool        escape;
+         ptr = scanString(string, escape, ptr, input);
+         link(parent, new String(m_name, string, escape));
+         m_state = StateNext;
+         return ptr;
+      }
+      break;
+   case 't':
+      {
+         if (input.match(ptr, "true", 4))
+         {
+            link(parent, new Boolean(m_name, true));
+            m_state = StateNext;
+            return input.next(ptr, 4);
+         }
+      }
+      break;
+   case 'f':
+      {
+         if (input.match(ptr, "false", 5))
+         {
+            link(parent, new Boolean(m_name, false));
+            m_state = StateNext;
+            return input.next(ptr, 5);
+         }
+      }
+      break;
+   case 'n':
+      {
+         if (input.match(ptr, "null", 4))
+         {
+            link(parent, new Null(m_name));
+            m_state = StateNext;
+            return input.next(ptr, 4);
+         }
+      }
+      break;
+   case '-':
+   case '0':
+   case '1':
+   case '2':
+   case '3':
+   case '4':
+   case '5':
+   case '6':
+   case '7':
+   case '8':
+   case '9':
+      {
+         double number;
+         ptr = scanNumber(number, ptr, input);
+         link(parent, new Number(m_name, number));
+         m_state = StateNext;
+         return ptr;
+      }
+      break;
+   default:
+      break;
+   }
+
+   throw JsonError("unexpected character");
+}
+
+template <class Input> const char *IncrementalParser::parseKey(const char *ptr, const Input &input)
+{
+   ptr = scanWhitespace(ptr, input);
+   if (input.at(ptr) != '\"')
+      throw JsonError("expected string key");
+   ptr = scanString(m_name, m_nameEscape, ptr, input);
+
+   ptr = scanWhitespace(ptr, input);
+   if (input.at(ptr) != ':')
+      throw JsonError("expected ':' before object value");
+
+   m_state = StateValue;
+   return input.next(ptr, 1);
+}
+
+template <class Input> const char *IncrementalParser::parseNext(const char *ptr, const Input &input)
+{
+   if (m_stack.empty())
+   {
+      if (Input::Strict && !input.atEnd(scanWhitespace(ptr, input)))
+         throw JsonError("unexpected data after JSON value");
+
+      m_state = StateDone;
+      return ptr;
+   }
+
+   Value *container = m_stack.back();
+   ptr = scanWhitespace(ptr, input);
+
+   if (container->getType() == TypeObject)
+   {
+      if (m_duplicates != DuplicateKeep)
+      {
+         Value  *value = container->m_lastChild;
+         Value **found = m_keys[m_stack.size() - 1]->insert(value);
+         if (found)
+         {
+            if (m_duplicates == DuplicateReject)
+               throw JsonError(std::string("duplicate key: ") + value->getNameStr());
+
+            container->removeValueInt(value);
+            (*found)->swapValueInt(value);
+            delete *found;
+            *found = value;
+         }
+      }
+
+      if (input.at(ptr) == ',')
+      {
+         m_state = StateKey;
+         return input.next(ptr, 1);
+      }
+
+      if (input.at(ptr) != '}')
+         throw JsonError("expected '}' or ',' after object element");
+   }
+   else
+   {
+      if (input.at(ptr) == ',')
+      {
+         m_state = StateValue;
+         return input.next(ptr, 1);
+      }
+
+      if (input.at(ptr) != ']')
+         throw JsonError("expected ']' or ',' after array element");
+   }
+
+   m_stack.pop_back();
+   return input.next(ptr, 1);
+}
+
+const char *Scanner::parseNumber(double &value, const char *ptr)
+{
+   return scanNumber(value, ptr, TextInput());
+}
+
+const char *Scanner::parseNumber(double &value, const char *ptr, const char *end)
+{
+   return scanNumber(value, ptr, BoundedInput(end));
+}
+
+const char *Scanner::whitespace(const char *ptr, const char *end)
+{
+   return scanWhitespace(ptr, BoundedInput(end));
+}
+
+const char *Scanner::parseString(std::string &value, const char *ptr)
+{
+   bool escape;
+   return parseString(value, escape, ptr);
+}
+
+const char *Scanner::parseString(std::string &value, bool &escape, const char *ptr)
+{
+   return scanString(value, escape, ptr, TextInput());
+}
+
+const char *Scanner::parseString(std::string &value, bool &escape, const char *ptr, const char *end)
+{
+   return scanString(value, escape, ptr, BoundedInput(end));
+}
+
+const char *Scanner::parseString(StringSink &sink, const char *ptr, size_t chunkSize)
+{
+   std::string buffer;
+   if (chunkSize < 4)
+      chunkSize = 4;
+   buffer.reserve(chunkSize);
+
+   ptr = skip(ptr, 1);
+   const char *start = ptr;
+
+   while (1)
+   {
+      if (*ptr != '\"' && *ptr != '\\' && *ptr)
+      {
+         ptr = skip(ptr, 1);
+         if ((size_t)(ptr - start) < chunkSize)
+            continue;
+      }
+
+      size_t run = ptr - start;
+      if (run)
+      {
+         if (buffer.size() + run > chunkSize)
+         {
+            if (!buffer.empty())
+               sink.append(buffer.data(), buffer.size());
+            buffer.clear();
+         }
+
+         if (run >= chunkSize)
+            sink.append(start, run);
+         else
+            buffer.append(start, run);
+      }
+
+      if (*ptr != '\\')
+      {
+         if (*ptr == '\"' || 0 == *ptr)
+            break;
+
+         start = ptr;
+         continue;
+      }
+
+      char   decoded[4];
+      size_t len;
+      ptr = parseEscape(decoded, len, skip(ptr, 1));
+
+      if (buffer.size() + len > chunkSize)
+      {
+         sink.append(buffer.data(), buffer.size());
+         buffer.clear();
+      }
+      buffer.append(decoded, len);
+
+      start = ptr;
+   }
+
+   if (!buffer.empty())
+      sink.append(buffer.data(), buffer.size());
+
+   if (0 == *ptr)
+      return ptr;
+
+   return skip(ptr, 1);
+}
+
+const char *Scanner::parseEscape(char *value, size_t &length, const char *ptr)
+{
+   return scanEscape(value, length, ptr, TextInput());
+}
+
+const char *Scanner::parseKey(const char *&key, size_t &length, std::string &scratch, const char *ptr)
+{
+   if (*ptr != '\"')
+      throw JsonError("expected string key");
+
+   const char *start = skip(ptr, 1);
+   const char *end   = start;
+
+   while (*end != '\"' && *end != '\\' && *end)
+      ++end;
+
+   if (*end == '\"')
+   {
+      key    = start;
+      length = end - start;
+      ptr    = skip(end, 1);
+   }
+   else
+   {
+      ptr    = parseString(scratch, ptr);
+      key    = scratch.data();
+      length = scratch.size();
+   }
+
+   ptr = whitespace(ptr);
+   if (*ptr != ':')
+      throw JsonError("expected ':' before object value");
+
+   return whitespace(skip(ptr, 1));
+}
+
+const char *Scanner::skipString(const char *ptr)
+{
+   ptr = skip(ptr, 1);
+   while (*ptr != '\"')
+   {
+      if (0 == *ptr)
+         throw JsonError("unterminated string");
+
+      if (*ptr == '\\' && ptr[1])
+         ptr = skip(ptr, 1);
+      ptr = skip(ptr, 1);
+   }
+
+   return skip(ptr, 1);
+}
+
+const char *Scanner::skipValue(const char *ptr)
+{
+   std::string stack;
+
+   do
+   {
+      ptr = whitespace(ptr);
+
+      switch (*ptr)
+      {
+      case '{':
+         stack += '}';
+         ptr = skip(ptr, 1);
+         break;
+      case '[':
+         stack += ']';
+         ptr = skip(ptr, 1);
+         break;
+      case '}':
+      case ']':
+         if (stack.empty() || stack[stack.size() - 1] != *ptr)
+            throw JsonError("unexpected character");
+         stack.erase(stack.size() - 1);
+         ptr = skip(ptr, 1);
+         break;
+      case ',':
+      case ':':
+         if (stack.empty())
+            throw JsonError("unexpected character");
+         ptr = skip(ptr, 1);
+         break;
+      case '\"':
+         ptr = skipString(ptr);
+         break;
+      case 't':
+      case 'n':
+         if (strncmp(ptr, "true", 4) && strncmp(ptr, "null", 4))
+            throw JsonError("unexpected character");
+         ptr = skip(ptr, 4);
+         break;
+      case 'f':
+         if (strncmp(ptr, "false", 5))
+            throw JsonError("unexpected character");
+         ptr = skip(ptr, 5);
+         break;
+      default:
+         {
+            if (*ptr != '-' && !isDigit(*ptr))
+               throw JsonError("unexpected character");
+
+            double number;
+            ptr = parseNumber(number, ptr);
+         }
+         break;
+      }
+   }
+   while (!stack.empty());
+
+   return ptr;
+}
+
+const char *Scanner::parseBase64(std::string &value, const char *ptr, bool lenient)
+{
+   ptr = skip(ptr, 1);
+   const char *start = ptr;
+
+   while (*ptr != '\"' && *ptr != '\\' && *ptr)
+      ptr = skip(ptr, 1);
+
+   if (*ptr == '\"')
+   {
+      decodeBase64(value, start, ptr - start, lenient);
+      return skip(ptr, 1);
+   }
+
+   if (0 == *ptr)
+      throw JsonError("unterminated string");
+
+   // escaped string, for example "\/" from some encoders
+   std::string text;
+   ptr = parseString(text, start - 1);
+   decodeBase64(value, text.data(), text.size(), lenient);
+   return ptr;
+}
+
+// Canonical input only: padded to whole groups and unused bits of the last group zero, so every byte string has
+// exactly one accepted encoding. Lenient mode also takes missing padding and non-zero unused bits.
+void Scanner::decodeBase64(std::string &value, const char *data, size_t length, bool lenient)
+{
+   size_t padding = 0;
+   while (padding < 2 && length && data[length - 1] == '=')
+   {
+      length--;
+      padding++;
+   }
+
+   if (length % 4 == 1)
+      throw JsonError("bad base64 length");
+   if (!lenient && (length + padding) % 4)
+      throw JsonError("bad base64 padding");
+
+   value.resize(length / 4 * 3 + (length % 4 ? length % 4 - 1 : 0));
+   if (value.empty())
+      return;
+
+   const unsigned char *in  = (const unsigned char *)data;
+   const unsigned char *end = in + length;
+   const unsigned char *table = base64Table.decode;
+   char                *out = &value[0];
+
+   // invalid characters have bit 7 set in the table, check them for whole group at once
+   while (end - in >= 4)
+   {
+      unsigned int a = table[in[0]], b = table[in[1]], c = table[in[2]], d = table[in[3]];
+      if ((a | b | c | d) & 0x80)
+         throw JsonError("bad base64 character");
+
+      unsigned int bits = (a << 18) | (b << 12) | (c << 6) | d;
+      out[0] = (char)(bits >> 16);
+      out[1] = (char)(bits >> 8);
+      out[2] = (char)bits;
+      in  += 4;
+      out += 3;
+   }
+
+   if (in != end)
+   {
+      unsigned int a = table[in[0]], b = table[in[1]], c = end - in > 2 ? table[in[2]] : 0;
+      if ((a | b | c) & 0x80)
+         throw JsonError("bad base64 character");
+
+      unsigned int bits = (a << 18) | (b << 12) | (c << 6);
+      if (!lenient && (bits & (end - in > 2 ? 0xFF : 0xFFFF)))
+         throw JsonError("bad base64 trailing bits");
+
+      out[0] = (char)(bits >> 16);
+      if (end - in > 2)
+         out[1] = (char)(bits >> 8);
+   }
+}
+
+void Scanner::encodeBase64(std::string &value, const char *data, size_t length)
+{
+   value.resize((length + 2) / 3 * 4);
+   if (length)
+      encodeBase64Block(&value[0], (const unsigned char *)data, length);
+}
+
+void Value::setName(std::string &name)
+{
+   m_name       = name;
+   m_nameEscape = Printer::needsEscaping(m_name.data(), m_name.size());
+}
+
+void Value::setName(const char *name)
+{
+   m_name       = name;
+   m_nameEscape = Printer::needsEscaping(m_name.data(), m_name.size());
+}
+
+void Value::swapName(std::string &name)
+{
+   m_name.swap(name);
+   m_nameEscape = Printer::needsEscaping(m_name.data(), m_name.size());
+}
+
+String::String(const std::string &value) : m_value(value) 
+{
+   m_escape = Printer::needsEscaping(m_value.data(), m_value.size());
+}
+
+String::String(const char *value) : m_value(value) 
+{
+   m_escape = Printer::needsEscaping(m_value.data(), m_value.size());
+}
+
+void String::setValue(const std::string &value)
+{
+   m_value  = value;
+   m_escape = Printer::needsEscaping(m_value.data(), m_value.size());
+}
+
+void String::setValue(const char *value)
+{
+   m_value  = value;
+   m_escape = Printer::needsEscaping(m_value.data(), m_value.size());
+}
+
+String *String::clone() const
+{
+   String *copy = new String(std::string());
+   copy->m_value  = m_value;
+   copy->m_escape = m_escape;
+   return copy;
+}
+
+void Utf16::toUtf8(std::string &out, const char *data, size_t size, bool bigEndian)
+{
+   if (size & 1)
+      throw JsonError("truncated utf-16 data");
+
+   out.clear();
+   transcodeUtf16(out, data, size, bigEndian);
+}
+
+void Utf16::fromUtf8(std::string &out, const char *data, size_t size, bool bigEndian)
+{
+   out.clear();
+   transcodeUtf8(out, data, size, bigEndian);
+}
+
+void Root::parseUtf16(const char *data, size_t size)
+{
+   const unsigned char *bytes     = (const unsigned char *)data;
+   bool                 bigEndian = false;
+
+   if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF)
+   {
+      bigEndian = true;
+      data += 2;
+      size -= 2;
+   }
+   else if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE)
+   {
+      data += 2;
+      size -= 2;
+   }
+   else if (size >= 2 && bytes[0] == 0 && bytes[1] != 0)
+      bigEndian = true;  // JSON text starts with ASCII character
+
+   if (size & 1)
+      throw JsonError("truncated utf-16 data");
+
+   // scanner reads code units in place, only string values are transcoded
+   IncrementalParser parser(*this, data, size, bigEndian ? EncodingUtf16BE : EncodingUtf16LE);
+   parser.step((size_t)-1);
+}
+
+namespace {
+
+// Stream buffer which takes UTF-8 text and writes it to another stream as UTF-16 in fixed size pieces
+class Utf16Writer : public std::streambuf
+{
+public:
+   Utf16Writer(std::ostream &out, bool bigEndian) : m_out(out), m_bigEndian(bigEndian)
+   {
+      setp(m_buffer, m_buffer + sizeof(m_buffer));
+   }
+
+   void finish() { write(true); }
+
+protected:
+   int_type overflow(int_type c)
+   {
+      write(false);
+      if (c != traits_type::eof())
+      {
+         *pptr() = (char)c;
+         pbump(1);
+      }
+      return traits_type::not_eof(c);
+   }
+
+   int sync()
+   {
+      write(false);
+      return 0;
+   }
+
+private:
+   // sequence cut at the end of the buffer is kept for the next piece
+   void write(bool last)
+   {
+      size_t size  = pptr() - pbase();
+      size_t whole = last ? size : complete(m_buffer, size);
+
+      m_units.clear();
+      transcodeUtf8(m_units, m_buffer, whole, m_bigEndian);
+      m_out.write(m_units.data(), m_units.size());
+
+      memmove(m_buffer, m_buffer + whole, size - whole);
+      setp(m_buffer, m_buffer + sizeof(m_buffer));
+      pbump((int)(size - whole));
+   }
+
+   static size_t complete(const char *data, size_t size)
+   {
+      for (size_t back = 1; back <= 3 && back <= size; ++back)
+      {
+         unsigned char c = (unsigned char)data[size - back];
+         if ((c & 0xC0) == 0x80)
+            continue;
+
+         size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+         return length > back ? size - back : size;
+      }
+      return size;
+   }
+
+private:
+   std::ostream &m_out;
+   bool          m_bigEndian;
+   std::string   m_units;
+   char          m_buffer[4096];
+};
+
+}
+
+void Root::printUtf16(std::ostream &out, bool format, bool bigEndian)
+{
+   Utf16Writer  writer(out, bigEndian);
+   std::ostream text(&writer);
+
+   // transcoding errors are thrown from the stream buffer, let them through
+   text.exceptions(std::ios::badbit);
+   print(text, format);
+   writer.finish();
+}
+
+namespace {
+
+// compares two JSON texts without building trees, both texts are read through bounded spans
+class JsonComparer
+{
+public:
+   struct Span
+   {
+      const char *ptr;
+      const char *end;
+   };
+
+   bool equal(Span &a, Span &b);
+
+   static void whitespace(Span &span)
+   {
+      while (span.ptr < span.end && (*span.ptr == 0x20 || *span.ptr == 0x09 || *span.ptr == 0x0A || *span.ptr == 0x0D))
+         span.ptr++;
+   }
+
+private:
+   struct Member
+   {
+      std::string key;
+      Span        value;
+
+      bool operator<(const Member &other) const { return key < other.key; }
+   };
+
+   static char peek(const Span &span) { return span.ptr < span.end ? *span.ptr : 0; }
+   static char kind(char c);
+
+   bool equalObject(Span &a, Span &b);
+   bool equalArray(Span &a, Span &b);
+   bool equalString(Span &a, Span &b);
+   bool equalNumber(Span &a, Span &b);
+   bool equalMembers(Span &a, Span &b, std::vector<Member> &membersA, std::vector<Member> &membersB);
+
+   static void   scanString(Span &span, const char *&start, const char *&stop, bool &escaped);
+   static void   decode(std::string &value, const char *start, const char *stop, bool escaped);
+   static void   key(Span &span, std::string &value);
+   static void   memberValue(Span &span, Member &member);
+   static char   separator(Span &span, char close);
+   static void   skipValue(Span &span);
+   static void   literal(Span &span, const char *word, size_t length);
+   static double number(Span &span);
+
+private:
+   std::string m_scratchA;
+   std::string m_scratchB;
+};
+
+char JsonComparer::kind(char c)
+{
+   switch (c)
+   {
+   case '{':
+   case '[':
+   case '\"':
+   case 't':
+   case 'f':
+   case 'n':
+      return c;
+   case '-':
+      return '0';
+   default:
+      if (Scanner::isDigit(c))
+         return '0';
+      throw JsonError("unexpected character");
+   }
+}
+
+bool JsonComparer::equal(Span &a, Span &b)
+{
+   whitespace(a);
+   whitespace(b);
+
+   char type = kind(peek(a));
+   if (type != kind(peek(b)))
+      return false;
+
+   switch (type)
+   {
+   case '{':
+      return equalObject(a, b);
+   case '[':
+      return equalArray(a, b);
+   case '\"':
+      return equalString(a, b);
+   case 't':
+      literal(a, "true", 4);
+      literal(b, "true", 4);
+      return true;
+   case 'f':
+      literal(a, "false", 5);
+      literal(b, "false", 5);
+      return true;
+   case 'n':
+      literal(a, "null", 4);
+      literal(b, "null", 4);
+      return true;
+   default:
+      return equalNumber(a, b);
+   }
+}
+
+bool JsonComparer::equalObject(Span &a, Span &b)
+{
+   a.ptr++;
+   b.ptr++;
+   whitespace(a);
+   whitespace(b);
+
+   bool emptyA = peek(a) == '}';
+   bool emptyB = peek(b) == '}';
+   if (emptyA || emptyB)
+   {
+      a.ptr += emptyA;
+      b.ptr += emptyB;
+      return emptyA && emptyB;
+   }
+
+   // members in the same order are compared in place, first reordered key switches to sorted member lists
+   std::string keyA, keyB;
+   while (1)
+   {
+      key(a, keyA);
+      key(b, keyB);
+
+      if (keyA != keyB)
+      {
+         std::vector<Member> membersA(1), membersB(1);
+         membersA[0].key.swap(keyA);
+         membersB[0].key.swap(keyB);
+         return equalMembers(a, b, membersA, membersB);
+      }
+
+      if (!equal(a, b))
+         return false;
+
+      char closeA = separator(a, '}');
+      char closeB = separator(b, '}');
+      if (closeA != closeB)
+         return false;
+      if (closeA == '}')
+         return true;
+   }
+}
+
+bool JsonComparer::equalMembers(Span &a, Span &b, std::vector<Member> &membersA, std::vector<Member> &membersB)
+{
+   // first members have keys already, their values start at the span position
+   memberValue(a, membersA.back());
+   while (separator(a, '}') == ',')
+   {
+      membersA.push_back(Member());
+      key(a, membersA.back().key);
+      memberValue(a, membersA.back());
+   }
+
+   memberValue(b, membersB.back());
+   while (separator(b, '}') == ',')
+   {
+      membersB.push_back(Member());
+      key(b, membersB.back().key);
+      memberValue(b, membersB.back());
+   }
+
+   if (membersA.size() != membersB.size())
+      return false;
+
+   std::stable_sort(membersA.begin(), membersA.end());
+   std::stable_sort(membersB.begin(), membersB.end());
+
+   for (size_t i = 0; i < membersA.size(); ++i)
+   {
+      if (membersA[i].key != membersB[i].key)
+         return false;
+   }
+
+   for (size_t i = 0; i < membersA.size(); ++i)
+   {
+      if (!equal(membersA[i].value, membersB[i].value))
+         return false;
+   }
+
+   return true;
+}
+
+bool JsonComparer::equalArray(Span &a, Span &b)
+{
+   a.ptr++;
+   b.ptr++;
+   whitespace(a);
+   whitespace(b);
+
+   bool emptyA = peek(a) == ']';
+   bool emptyB = peek(b) == ']';
+   if (emptyA || emptyB)
+   {
+      a.ptr += emptyA;
+      b.ptr += emptyB;
+      return emptyA && emptyB;
+   }
+
+   while (1)
+   {
+      if (!equal(a, b))
+         return false;
+
+      char closeA = separator(a, ']');
+      char closeB = separator(b, ']');
+      if (closeA != closeB)
+         return false;
+      if (closeA == ']')
+         return true;
+   }
+}
+
+bool JsonComparer::equalString(Span &a, Span &b)
+{
+   const char *startA, *stopA, *startB, *stopB;
+   bool        escapedA, escapedB;
+   scanString(a, startA, stopA, escapedA);
+   scanString(b, startB, stopB, escapedB);
+
+   if (!escapedA && !escapedB)
+      return stopA - startA == stopB - startB && !memcmp(startA, startB, stopA - startA);
+
+   decode(m_scratchA, startA, stopA, escapedA);
+   decode(m_scratchB, startB, stopB, escapedB);
+   return m_scratchA == m_scratchB;
+}
+
+bool JsonComparer::equalNumber(Span &a, Span &b)
+{
+   double valueA = number(a);
+   double valueB = number(b);
+   return valueA == valueB;
+}
+
+void JsonComparer::scanString(Span &span, const char *&start, const char *&stop, bool &escaped)
+{
+   start   = ++span.ptr;
+   escaped = false;
+
+   while (span.ptr < span.end && *span.ptr != '\"')
+   {
+      if (*span.ptr == '\\')
+      {
+         escaped = true;
+         span.ptr++;
+      }
+      span.ptr++;
+   }
+
+   if (span.ptr >= span.end)
+      throw JsonError("unterminated string");
+
+   stop = span.ptr++;
+}
+
+void JsonComparer::decode(std::string &value, const char *start, const char *stop, bool escaped)
+{
+   if (!escaped)
+   {
+      value.assign(start, stop - start);
+      return;
+   }
+
+   // start and stop are inside the quotes
+   bool escape;
+   Scanner::parseString(value, escape, start - 1, stop + 1);
+}
+
+void JsonComparer::key(Span &span, std::string &value)
+{
+   whitespace(span);
+   if (peek(span) != '\"')
+      throw JsonError("expected string key");
+
+   const char *start, *stop;
+   bool        escaped;
+   scanString(span, start, stop, escaped);
+   decode(value, start, stop, escaped);
+
+   whitespace(span);
+   if (peek(span) != ':')
+      throw JsonError("expected ':' before object value");
+   span.ptr++;
+}
+
+void JsonComparer::memberValue(Span &span, Member &member)
+{
+   whitespace(span);
+   member.value.ptr = span.ptr;
+   skipValue(span);
+   member.value.end = span.ptr;
+}
+
+char JsonComparer::separator(Span &span, char close)
+{
+   whitespace(span);
+
+   char c = peek(span);
+   if (c != ',' && c != close)
+      throw JsonError(close == '}' ? "expected '}' or ',' after object element" : "expected ']' or ',' after array element");
+
+   span.ptr++;
+   return c;
+}
+
+void JsonComparer::skipValue(Span &span)
+{
+   int depth = 0;
+   do
+   {
+      whitespace(span);
+      char c = peek(span);
+
+      if (c == '\"')
+      {
+         const char *start, *stop;
+         bool        escaped;
+         scanString(span, start, stop, escaped);
+      }
+      else if (c == '{' || c == '[')
+      {
+         depth++;
+         span.ptr++;
+      }
+      else if (c == '}' || c == ']')
+      {
+         if (--depth < 0)
+            throw JsonError("unexpected character");
+         span.ptr++;
+      }
+      else if (c == ',' || c == ':')
+      {
+         if (!depth)
+            throw JsonError("unexpected character");
+         span.ptr++;
+      }
+      else if (c)
+      {
+         while (span.ptr < span.end && strchr(",:[]{} \t\r\n\"", *span.ptr) == 0)
+            span.ptr++;
+      }
+      else
+         throw JsonError("unexpected end of data");
+   }
+   while (depth);
+}
+
+void JsonComparer::literal(Span &span, const char *word, size_t length)
+{
+   if ((size_t)(span.end - span.ptr) < length || strncmp(span.ptr, word, length) != 0)
+      throw JsonError("unexpected character");
+   span.ptr += length;
+}
+
+double JsonComparer::number(Span &span)
+{
+   double value;
+   span.ptr = Scanner::parseNumber(value, span.ptr, span.end);
+
+   if (span.ptr < span.end && (!*span.ptr || strchr(",:[]{} \t\r\n", *span.ptr) == 0))
+      throw JsonError("unexpected character");
+   return value;
+}
+
+}
+
+bool equalJson(const char *a, size_t lengthA, const char *b, size_t lengthB)
+{
+   JsonComparer::Span spanA = { a, a + lengthA };
+   JsonComparer::Span spanB = { b, b + lengthB };
+
+   JsonComparer comparer;
+   if (!comparer.equal(spanA, spanB))
+      return false;
+
+   JsonComparer::whitespace(spanA);
+   JsonComparer::whitespace(spanB);
+   if (spanA.ptr != spanA.end || spanB.ptr != spanB.end)
+      throw JsonError("unexpected data after JSON value");
+
+   return true;
+}
+
+void String::getBinary(std::string &value, bool lenient) const
+{
+   Scanner::decodeBase64(value, m_value.data(), m_value.size(), lenient);
+}
+
+void String::setBinary(const void *data, size_t size)
+{
+   Scanner::encodeBase64(m_value, (const char *)data, size);
+   m_escape = false;
+}
+
+const char *Scanner::parseUnicode(int &value, const char *ptr)
+{
+   return scanUnicode(value, ptr, TextInput());
+}
+
+const Array &Root::getArray() const
+{
+   if (!m_firstChild || m_firstChild->getType() != TypeArray)
+      throw JsonError("value is not an array");
+
+   return m_firstChild->toArray();
+}
+
+const Object &Root::getObject() const
+{ 
+   if (!m_firstChild || m_firstChild->getType() != TypeObject)
+      throw JsonError("value is not an object");
+
+   return m_firstChild->toObject();
+}
+
+Value *Root::linkValue(Value *value) 
+{
+   if (m_firstChild)
+      delete m_firstChild;
+   m_firstChild = m_lastChild = value;
+   m_length     = value ? 1 : 0;
+   if (value)
+      value->m_parent = this;
+   return value;
+}
+
+Value &Root::setValue(Value &value)
+{
+   Value *newv = value.clone();
+   linkValue(newv);
+   return *newv;
+}
+
+Value *Transformer::visit(String &value)
+{
+   return &value;
+}
+
+Value *Transformer::visit(Number &value)
+{
+   return &value;
+}
+
+Value *Transformer::visit(Boolean &value)
+{
+   return &value;
+}
+
+Value *Transformer::visit(Null &value)
+{
+   return &value;
+}
+
+void Root::transform(Transformer &transformer)
+{
+   Value *node = m_firstChild;
+   while (node)
+   {
+      Value    *result;
+      ValueType type = node->getType();
+
+      switch (type)
+      {
+      case TypeObject:
+      case TypeArray:
+         result = transformer.enter(*node);
+         break;
+      case TypeString:
+         result = transformer.visit(static_cast<String &>(*node));
+         break;
+      case TypeNumber:
+         result = transformer.visit(static_cast<Number &>(*node));
+         break;
+      case TypeBoolean:
+         result = transformer.visit(static_cast<Boolean &>(*node));
+         break;
+      default:
+         result = transformer.visit(static_cast<Null &>(*node));
+         break;
+      }
+
+      if (result == node && node->m_firstChild)
+      {
+         node = node->m_firstChild;
+         continue;
+      }
+
+      if (result == node && (type == TypeObject || type == TypeArray))
+         result = transformer.exit(*node);
+
+      // walk up while the finished value is the last child, exit() is called on each parent
+      for (;;)
+      {
+         Value *next   = node->m_next;
+         Value *parent = node->m_parent;
+
+         replaceTransformed(node, result);
+         if (next || parent == this)
+         {
+            node = next;
+            break;
+         }
+
+         node   = parent;
+         result = transformer.exit(*node);
+      }
+   }
+}
+
+void Root::replaceTransformed(Value *value, Value *result)
+{
+   if (result == value)
+      return;
+
+   Value  *parent = value->m_parent;
+   Object *object = parent->getType() == TypeObject ? static_cast<Object *>(parent) : 0;
+
+   if (!result)
+   {
+      parent->removeValueInt(value);
+      if (object)
+         object->lookupReplace(value, 0);
+      delete value;
+      return;
+   }
+
+   if (result->m_next || result->m_parent || result->m_prev)
+      throw JsonError("value is already linked to JSON object");
+
+   if (object && result->m_name.empty())
+   {
+      result->m_name.swap(value->m_name);
+      result->m_nameEscape = value->m_nameEscape;
+   }
+
+   value->swapValueInt(result);
+   if (object)
+      object->lookupReplace(value, result);
+   delete value;
+}
+
+void Path::toPointer(std::string &out) const
+{
+   out.clear();
+
+   for (size_t i = 0; i < m_segments.size(); ++i)
+   {
+      out += '/';
+
+      const std::string *name = m_segments[i].name;
+      if (!name)
+      {
+         char index[16];
+         sprintf(index, "%d", m_segments[i].index);
+         out += index;
+         continue;
+      }
+
+      for (size_t c = 0; c < name->size(); ++c)
+      {
+         if ((*name)[c] == '~')
+            out += "~0";
+         else if ((*name)[c] == '/')
+            out += "~1";
+         else
+            out += (*name)[c];
+      }
+   }
+}
+
+bool PathTraversal::traverse(const Value &value, PathVisitor &visitor)
+{
+   m_visitor = &visitor;
+   m_path.m_segments.clear();
+   m_counters.clear();
+
+   return value.traverse(*this);
+}
+
+bool PathTraversal::enter(const Value &value)
+{
+   push(value);
+   bool result = m_visitor->enter(value, m_path);
+   m_counters.push_back(0);
+   return result;
+}
+
+bool PathTraversal::visit(const String &value)
+{
+   return leaf(value);
+}
+
+bool PathTraversal::visit(const Number &value)
+{
+   return leaf(value);
+}
+
+bool PathTraversal::visit(const Boolean &value)
+{
+   return leaf(value);
+}
+
+bool PathTraversal::visit(const Null &value)
+{
+   return leaf(value);
+}
+
+bool PathTraversal::exit(const Value &value)
+{
+   m_counters.pop_back();
+   bool result = m_visitor->exit(value, m_path);
+   pop();
+   return result;
+}
+
+bool Printer::enter(const Value &value) 
+{
+   if (value.previousSibling())
+   {
+      m_out << ',';
+      printLineBreak();
+   }
+   printIndent();
+   printName(value);
+
+   if (value.getType() == TypeArray)
+      m_out << '[';
+   else if (value.getType() == TypeObject)
+      m_out << '{';
+
+   printLineBreak();
+   m_depth++;
+
+   return true; 
+}
+
+bool Printer::visit(const Boolean &value) 
+{
+   printSeparator(value);
+   printName(value);
+
+   if (value.getValue())
+      m_out << "true";
+   else
+      m_out << "false";
+
+   return true; 
+}
+
+bool Printer::visit(const Null &value) 
+{
+   printSeparator(value);
+   printName(value);
+   m_out << "null";
+   return true;
+}
+
+bool Printer::visit(const String &value)
+{
+   printSeparator(value);
+   printName(value);
+   printString(value.getValueStr(), value.needsEscaping());
+
+   return true;
+}
+
+bool Printer::visit(const Number &value)
+{
+   printSeparator(value);
+   printName(value);
+   printNumber(value.getValue());
+
+   return true;
+}
+
+bool Printer::exit(const Value &value) 
+{
+   m_depth--;
+   printLineBreak();
+   printIndent();
+
+   if (value.getType() == TypeArray)
+      m_out << ']';
+   else if (value.getType() == TypeObject)
+      m_out << '}';
+
+   return true; 
+}
+
+void Printer::printBase64(const char *data, size_t size)
+{
+   // base64 alphabet never needs escaping, encoded blocks are written as is
+   char                 buffer[4096];
+   const unsigned char *in = (const unsigned char *)data;
+
+   m_out << '\"';
+   while (size)
+   {
+      size_t block = std::min(size, sizeof(buffer) / 4 * 3);
+      m_out.write(buffer, encodeBase64Block(buffer, in, block));
+      in   += block;
+      size -= block;
+   }
+   m_out << '\"';
+}
+
+bool Printer::needsEscaping(const char *str, size_t size)
+{
+   const char *end = str + size;
+   while (str < end)
+   {
+      unsigned char c = (unsigned char)*str++;
+      if (c < 32 || c == '\"' || c == '\\')
+         return true;
+   }
+
+   return false;
+}
+
+void Printer::printEscapedString(const std::string &value)
+{
+   m_out << '\"';
+
+   const char *str = value.c_str();
+   const char *ptr = str;
+
+   while (*ptr)
+   {
+      if ((unsigned char)*ptr > 31 && *ptr != '\"' && *ptr != '\\')
+         ptr++;
+      else
+      {
+         if (ptr != str)
+            m_out.write(str, ptr - str);
+         
+         switch (*ptr)
+         {
+         case '\\':
+            m_out << "\\\\";
+            break;
+         case '\"':
+            m_out << "\\\"";
+            break;
+         case '\b':
+            m_out << "\\b";
+            break;
+         case '\f':
+            m_out << "\\f";
+            break;
+         case '\n':
+            m_out << "\\n";
+            break;
+         case '\r':
+            m_out << "\\r";
+            break;
+         case '\t':
+            m_out << "\\t";
+            break;
+         default:
+            const char *hex = {"0123456789abcdef"};
+            m_out << "\\u00";
+            m_out << hex[(unsigned char)*ptr >> 4];
+            m_out << hex[(unsigned char)*ptr & 0x0f];
+            break;
+         }
+
+         str = ++ptr;
+      }
+   }
+
+   if (ptr != str)
+      m_out.write(str, ptr - str);
+   
+   m_out << '\"';
+}
+
+namespace {
+
+const char ellipsis[] = "\xE2\x80\xA6";
+
+// largest size not greater than "size" (and not less than "start") which doesn't cut UTF-8 sequence
+size_t utf8Boundary(const std::string &str, size_t size, size_t start = 0)
+{
+   while (size > start && size < str.size() && ((unsigned char)str[size] & 0xC0) == 0x80)
+      size--;
+   return size;
+}
+
+}
+
+PreviewPrinter::PreviewPrinter(std::string &out, const PreviewLimits &limits) : 
+   m_out(out), 
+   m_start(out.size()), 
+   m_limits(limits), 
+   m_done(false), 
+   m_truncated(false),
+   m_printer(m_scratch)
+{
+}
+
+bool PreviewPrinter::enter(const Value &value)
+{
+   Level level = { 0, !m_done && begin(value) };
+   m_levels.push_back(level);
+   if (!level.shown)
+      return false;
+
+   m_out += value.getType() == TypeArray ? '[' : '{';
+   if (m_levels.size() > (size_t)m_limits.depth && value.firstChild())
+   {
+      // children are skipped, exit() closes the container
+      m_out += ellipsis;
+      m_truncated = true;
+      check();
+      return false;
+   }
+
+   return check();
+}
+
+bool PreviewPrinter::visit(const Boolean &value)
+{
+   if (m_done || !begin(value))
+      return false;
+
+   m_out += value.getValue() ? "true" : "false";
+   return check();
+}
+
+bool PreviewPrinter::visit(const String &value)
+{
+   if (m_done || !begin(value))
+      return false;
+
+   printString(value.getValueStr(), value.needsEscaping());
+   return check();
+}
+
+bool PreviewPrinter::visit(const Number &value)
+{
+   if (m_done || !begin(value))
+      return false;
+
+   m_scratch.str("");
+   m_printer.printNumber(value.getValue());
+   m_out += m_scratch.str();
+   return check();
+}
+
+bool PreviewPrinter::visit(const Null &value)
+{
+   if (m_done || !begin(value))
+      return false;
+
+   m_out += "null";
+   return check();
+}
+
+bool PreviewPrinter::exit(const Value &value)
+{
+   Level level = m_levels.back();
+   m_levels.pop_back();
+
+   if (!level.shown || m_done)
+      return false;
+
+   m_out += value.getType() == TypeArray ? ']' : '}';
+   return check();
+}
+
+bool PreviewPrinter::begin(const Value &value)
+{
+   if (m_levels.empty())
+      return true;
+
+   Level &level = m_levels.back();
+   if (level.count >= m_limits.elements)
+   {
+      // returning false skips remaining elements of the parent
+      if (level.count)
+         m_out += ',';
+      m_out += ellipsis;
+      m_truncated = true;
+      return false;
+   }
+
+   if (level.count++)
+      m_out += ',';
+
+   if (value.parent() && value.parent()->getType() == TypeObject)
+   {
+      printString(value.getNameStr(), value.needsNameEscaping());
+      m_out += ':';
+   }
+
+   return true;
+}
+
+void PreviewPrinter::printString(const std::string &value, bool escape)
+{
+   if (value.size() <= m_limits.stringLength)
+   {
+      m_scratch.str("");
+      m_printer.printString(value, escape);
+      m_out += m_scratch.str();
+      return;
+   }
+
+   m_scratch.str("");
+   m_printer.printString(value.substr(0, utf8Boundary(value, m_limits.stringLength)), escape);
+
+   std::string text = m_scratch.str();
+   text.insert(text.size() - 1, ellipsis);
+   m_out += text;
+   m_truncated = true;
+}
+
+bool PreviewPrinter::check()
+{
+   size_t size = m_out.size() - m_start;
+   if (size <= m_limits.bytes)
+      return true;
+
+   m_out.resize(utf8Boundary(m_out, m_start + m_limits.bytes, m_start));
+   m_out += ellipsis;
+   m_done      = true;
+   m_truncated = true;
+   return false;
+}
+
+GatherBuffer::int_type GatherBuffer::overflow(int_type c)
+{
+   if (!traits_type::eq_int_type(c, traits_type::eof()))
+      m_scratch += traits_type::to_char_type(c);
+   return traits_type::not_eof(c);
+}
+
+std::streamsize GatherBuffer::xsputn(const char *str, std::streamsize count)
+{
+   m_scratch.append(str, (size_t)count);
+   return count;
+}
+
+void GatherBuffer::closeScratch()
+{
+   if (m_mark < m_scratch.size())
+   {
+      Piece piece = { 0, m_mark, m_scratch.size() - m_mark };
+      m_pieces.push_back(piece);
+      m_mark = m_scratch.size();
+   }
+}
+
+void GatherBuffer::reference(const char *data, size_t size)
+{
+   closeScratch();
+
+   Piece piece = { data, 0, size };
+   m_pieces.push_back(piece);
+}
+
+void GatherBuffer::clear()
+{
+   m_scratch.clear();
+   m_pieces.clear();
+   m_segments.clear();
+   m_mark = 0;
+}
+
+const std::vector<Segment> &GatherBuffer::segments()
+{
+   closeScratch();
+
+   m_segments.resize(m_pieces.size());
+   for (size_t i = 0; i < m_pieces.size(); ++i)
+   {
+      m_segments[i].data = m_pieces[i].external ? m_pieces[i].external : m_scratch.data() + m_pieces[i].offset;
+      m_segments[i].size = m_pieces[i].size;
+   }
+
+   return m_segments;
+}
+
+size_t GatherBuffer::size() const
+{
+   size_t size = m_scratch.size();
+   for (size_t i = 0; i < m_pieces.size(); ++i)
+   {
+      if (m_pieces[i].external)
+         size += m_pieces[i].size;
+   }
+   return size;
+}
+
+namespace {
+const char   recordIndexMagic[8] = { 'C', 'W', 'J', 'S', 'O', 'N', 'I', '2' };
+const size_t recordIndexBlock    = 1 << 20;
+const size_t recordIndexProbe    = 4096;
+
+void findNewlines(const char *data, size_t begin, size_t end, std::vector<size_t> &newlines)
+{
+   const char *ptr  = data + begin;
+   const char *last = data + end;
+
+   while (ptr < last)
+   {
+      const char *found = (const char *)memchr(ptr, '\n', last - ptr);
+      if (!found)
+         break;
+      newlines.push_back(found - data);
+      ptr = found + 1;
+   }
+}
+
+bool seekFile(FILE *file, Uint64 offset)
+{
+#if defined(_WIN32)
+   return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+   return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+bool fileEnd(FILE *file, Uint64 &size)
+{
+#if defined(_WIN32)
+   if (_fseeki64(file, 0, SEEK_END) != 0)
+      return false;
+   __int64 position = _ftelli64(file);
+#else
+   if (fseeko(file, 0, SEEK_END) != 0)
+      return false;
+   off_t position = ftello(file);
+#endif
+   size = (Uint64)position;
+   return position >= 0;
+}
+
+void writeUint64(char *out, Uint64 value)
+{
+   for (int i = 0; i < 8; ++i)
+      out[i] = (char)(value >> (i * 8));
+}
+
+Uint64 readUint64(const char *in)
+{
+   Uint64 value = 0;
+   for (int i = 7; i >= 0; --i)
+      value = (value << 8) | (unsigned char)in[i];
+   return value;
+}
+
+// FNV-1a of the first and last bytes of the data, catches a file rewritten with the same size
+Uint64 probeHash(const char *head, const char *tail, size_t size)
+{
+   Uint64 hash  = ((Uint64)0xCBF29CE4 << 32) | 0x84222325;
+   Uint64 prime = ((Uint64)0x100 << 32) | 0x1B3;
+
+   for (size_t i = 0; i < size; ++i)
+      hash = (hash ^ (unsigned char)head[i]) * prime;
+   for (size_t i = 0; i < size; ++i)
+      hash = (hash ^ (unsigned char)tail[i]) * prime;
+   return hash;
+}
+
+bool probeFile(FILE *file, Uint64 fileSize, Uint64 &hash)
+{
+   size_t            size = (size_t)std::min((Uint64)recordIndexProbe, fileSize);
+   std::vector<char> head(size + 1), tail(size + 1);
+
+   if (!seekFile(file, 0) || fread(&head[0], 1, size, file) != size)
+      return false;
+   if (!seekFile(file, fileSize - size) || fread(&tail[0], 1, size, file) != size)
+      return false;
+
+   hash = probeHash(&head[0], &tail[0], size);
+   return true;
+}
+}
+
+void RecordIndex::addLines(const char *data, size_t size, const std::vector<size_t> &newlines, Uint64 base, Uint64 &start, bool &content)
+{
+   // line start inside data, a line continued from the previous block starts at 0
+   size_t line = start > base ? (size_t)(start - base) : 0;
+
+   for (size_t i = 0; i < newlines.size(); ++i)
+   {
+      // Skip blank and whitespace-only lines so that every offset names a real record.
+      if (content || Scanner::whitespace(data + line, data + newlines[i]) != data + newlines[i])
+         m_offsets.push_back(start);
+
+      start   = base + newlines[i] + 1;
+      line    = newlines[i] + 1;
+      content = false;
+   }
+
+   // the rest of data starts a line that ends in the next block
+   if (!content)
+      content = Scanner::whitespace(data + line, data + size) != data + size;
+}
+
+void RecordIndex::build(const char *data, size_t size, int threads)
+{
+   size_t probe = std::min(recordIndexProbe, size);
+
+   m_offsets.clear();
+   m_fileSize = size;
+   m_probe    = probeHash(data, data + size - probe, probe);
+
+   std::vector<std::vector<size_t> > parts(1);
+   std::vector<size_t>               ends(1, size);
+
+#if CWJSON_THREADS
+   if (threads <= 0)
+      threads = std::max(1, (int)std::thread::hardware_concurrency());
+   if ((size_t)threads > size / recordIndexBlock)
+      threads = (int)std::max((size_t)1, size / recordIndexBlock);
+
+   if (threads > 1)
+   {
+      std::vector<std::thread> workers;
+      size_t                   chunk = size / threads;
+
+      parts.resize(threads);
+      ends.resize(threads);
+      for (int i = 0; i < threads; ++i)
+      {
+         size_t begin = chunk * i;
+         size_t end   = i + 1 == threads ? size : begin + chunk;
+         std::vector<size_t> *part = &parts[i];
+         ends[i] = end;
+         workers.push_back(std::thread([=]() { findNewlines(data, begin, end, *part); }));
+      }
+      for (size_t i = 0; i < workers.size(); ++i)
+         workers[i].join();
+   }
+   else
+#else
+   (void)threads;
+#endif
+      findNewlines(data, 0, size, parts[0]);
+
+   Uint64 start   = 0;
+   bool   content = false;
+   for (size_t i = 0; i < parts.size(); ++i)
+      addLines(data, ends[i], parts[i], 0, start, content);
+
+   if (content)
+      m_offsets.push_back(start);
+   m_offsets.push_back(size);
+}
+
+bool RecordIndex::build(FILE *file)
+{
+   m_offsets.clear();
+   m_fileSize = 0;
+   m_probe    = 0;
+
+   if (!file || !seekFile(file, 0))
+      return false;
+
+   std::vector<char>   buffer(recordIndexBlock);
+   std::vector<size_t> newlines;
+   Uint64              start   = 0;
+   bool                content = false;
+   size_t              read;
+
+   while ((read = fread(&buffer[0], 1, buffer.size(), file)) > 0)
+   {
+      newlines.clear();
+      findNewlines(&buffer[0], 0, read, newlines);
+      addLines(&buffer[0], read, newlines, m_fileSize, start, content);
+      m_fileSize += read;
+   }
+   if (ferror(file) || !probeFile(file, m_fileSize, m_probe))
+      return false;
+
+   if (content)
+      m_offsets.push_back(start);
+   m_offsets.push_back(m_fileSize);
+
+   return true;
+}
+
+bool RecordIndex::save(const char *path) const
+{
+   FILE *file = fopen(path, "wb");
+   if (!file)
+      return false;
+
+   char header[32];
+   memcpy(header, recordIndexMagic, 8);
+   writeUint64(header + 8, m_fileSize);
+   writeUint64(header + 16, size());
+   writeUint64(header + 24, m_probe);
+
+   bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+   std::vector<char> block;
+   for (size_t i = 0; ok && i < m_offsets.size(); i += recordIndexBlock / 8)
+   {
+      size_t count = std::min(m_offsets.size() - i, recordIndexBlock / 8);
+      block.resize(count * 8);
+      for (size_t j = 0; j < count; ++j)
+         writeUint64(&block[j * 8], m_offsets[i + j]);
+      ok = fwrite(&block[0], 1, block.size(), file) == block.size();
+   }
+
+   return fclose(file) == 0 && ok;
+}
+
+bool RecordIndex::load(const char *path)
+{
+   FILE *file = fopen(path, "rb");
+   if (!file)
+      return false;
+
+   char header[32];
+   bool ok = fread(header, 1, sizeof(header), file) == sizeof(header) && memcmp(header, recordIndexMagic, 8) == 0;
+
+   std::vector<Uint64> offsets;
+   Uint64              fileSize = ok ? readUint64(header + 8) : 0;
+   Uint64              count    = ok ? readUint64(header + 16) : 0;
+   Uint64              probe    = ok ? readUint64(header + 24) : 0;
+
+   std::vector<char> block(recordIndexBlock);
+   while (ok && offsets.size() < count + 1)
+   {
+      size_t wanted = (size_t)std::min((Uint64)(recordIndexBlock / 8), count + 1 - offsets.size());
+      ok            = fread(&block[0], 1, wanted * 8, file) == wanted * 8;
+      for (size_t j = 0; ok && j < wanted; ++j)
+      {
+         Uint64 offset = readUint64(&block[j * 8]);
+         ok            = offset <= fileSize && (offsets.empty() || offset > offsets.back());
+         offsets.push_back(offset);
+      }
+   }
+   fclose(file);
+
+   if (!ok || offsets.empty() || offsets.back() != fileSize)
+      return false;
+
+   m_offsets.swap(offsets);
+   m_fileSize = fileSize;
+   m_probe    = probe;
+   return true;
+}
+
+bool RecordIndex::matches(FILE *file) const
+{
+   Uint64 size, probe;
+   return file && !m_offsets.empty() && fileEnd(file, size) && size == m_fileSize && 
+          probeFile(file, size, probe) && probe == m_probe;
+}
+
+void RecordIndex::record(const char *data, size_t i, Root &root) const
+{
+   if (i >= size())
+      throw JsonError("record out of range");
+
+   root.parse(data + m_offsets[i], length(i));
+}
+
+void RecordIndex::record(FILE *file, size_t i, Root &root) const
+{
+   if (i >= size())
+      throw JsonError("record out of range");
+
+   std::string text(length(i), '\0');
+   if (!seekFile(file, m_offsets[i]) || fread(&text[0], 1, text.size(), file) != text.size())
+      throw JsonError("can't read record");
+
+   root.parse(text.data(), text.size());
+}
+
+void DocumentSplitter::feed(const char *data, size_t size)
+{
+   if (m_mode == SplitLines)
+   {
+      feedLines(data, size);
+      return;
+   }
+
+   const char *ptr   = data;
+   const char *end   = data + size;
+   const char *start = data;
+
+   while (ptr < end)
+   {
+      char c = *ptr;
+
+      if (m_inString)
+      {
+         if (m_escape)
+            m_escape = false;
+         else if (c == '\\')
+            m_escape = true;
+         else if (c == '\"')
+         {
+            m_inString = false;
+            if (m_depth == 0)
+            {
+               m_current.append(start, ptr + 1 - start);
+               emit();
+               start = ptr + 1;
+            }
+         }
+         ++ptr;
+         continue;
+      }
+
+      if (m_inScalar)
+      {
+         if (c != 0x20 && c != 0x09 && c != 0x0A && c != 0x0D && c != '{' && c != '[' && c != '\"' && c != ',')
+         {
+            ++ptr;
+            continue;
+         }
+
+         m_current.append(start, ptr - start);
+         emit();
+         start = ptr;
+      }
+
+      if (m_depth == 0)
+      {
+         if (c == 0x20 || c == 0x09 || c == 0x0A || c == 0x0D || c == ',')
+         {
+            start = ++ptr;
+            continue;
+         }
+
+         m_started = true;
+         if (c == '{' || c == '[')
+            m_depth = 1;
+         else if (c == '\"')
+            m_inString = true;
+         else
+            m_inScalar = true;
+
+         ++ptr;
+         continue;
+      }
+
+      if (c == '\"')
+         m_inString = true;
+      else if (c == '{' || c == '[')
+         m_depth++;
+      else if (c == '}' || c == ']')
+      {
+         if (--m_depth == 0)
+         {
+            m_current.append(start, ptr + 1 - start);
+            emit();
+            start = ptr + 1;
+         }
+      }
+      ++ptr;
+   }
+
+   if (m_started && ptr != start)
+      m_current.append(start, ptr - start);
+}
+
+void DocumentSplitter::feedLines(const char *data, size_t size)
+{
+   const char *end = data + size;
+
+   while (data < end)
+   {
+      const char *newline = (const char *)memchr(data, '\n', end - data);
+      if (!newline)
+      {
+         m_current.append(data, end - data);
+         return;
+      }
+
+      m_current.append(data, newline - data);
+      emitLine();
+      data = newline + 1;
+   }
+}
+
+void DocumentSplitter::finish()
+{
+   if (m_mode == SplitLines)
+      emitLine();
+   else if (m_started)
+      emit();
+
+   m_depth    = 0;
+   m_inString = false;
+   m_escape   = false;
+}
+
+bool DocumentSplitter::next(std::string &document)
+{
+   if (m_documents.empty())
+      return false;
+
+   document.swap(m_documents.front());
+   m_documents.pop_front();
+   return true;
+}
+
+void DocumentSplitter::emit()
+{
+   m_documents.push_back(std::string());
+   m_documents.back().swap(m_current);
+   m_inScalar = false;
+   m_started  = false;
+}
+
+void DocumentSplitter::emitLine()
+{
+   const char *begin = m_current.data();
+   const char *end   = begin + m_current.size();
+
+   if (Scanner::whitespace(begin, end) != end)
+      emit();
+   else
+      m_current.clear();
+}
+
+#if CWJSON_THREADS
+
+namespace {
+
+double elapsed(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Released roots and grown parser stacks of the thread, reused by the next parse on it
+struct ParserCache
+{
+   ~ParserCache()
+   {
+      for (size_t i = 0; i < roots.size(); ++i)
+         delete roots[i];
+      for (size_t i = 0; i < keys.size(); ++i)
+         delete keys[i];
+   }
 
-         switch (*ptr)
+   std::vector<Root *>     roots;
+   std::vector<Value *>    stack;
+   std::vector<KeyIndex *> keys;
+   std::string             name;
+};
+
+thread_local ParserCache t_parserCache;
+
+}
+
+Root *ParserPool::acquire()
+{
+   ParserCache &cache = t_parserCache;
+   if (cache.roots.empty())
+      return new Root();
+
+   Root *root = cache.roots.back();
+   cache.roots.pop_back();
+   return root;
+}
+
+void ParserPool::release(Root *root)
+{
+   if (!root)
+      return;
+
+   ParserCache &cache = t_parserCache;
+   if (cache.roots.size() >= Limit)
+   {
+      delete root;
+      return;
+   }
+
+   root->clear();
+   root->setDuplicateMode(DuplicateKeep);
+   cache.roots.push_back(root);
+}
+
+void ParserPool::reserve(size_t nodes)
+{
+   NodePool::reserve(sizeof(Object), nodes / 4);
+   NodePool::reserve(sizeof(String), nodes);
+   NodePool::reserve(sizeof(Number), nodes);
+}
+
+Root *ParserPool::parse(const char *json)
+{
+   Root              *root  = acquire();
+   ParserCache       &cache = t_parserCache;
+   IncrementalParser  parser(*root, json);
+
+   // parser runs on the stacks left by the previous parse, key indexes are cleared on reuse
+   auto exchange = [&]() {
+      parser.m_stack.clear();
+      parser.m_stack.swap(cache.stack);
+      parser.m_keys.swap(cache.keys);
+      parser.m_name.swap(cache.name);
+   };
+
+   exchange();
+   try
+   {
+      parser.step((size_t)-1);
+   }
+   catch (...)
+   {
+      // failed root goes back to the pool cleared, like any released one
+      exchange();
+      release(root);
+      throw;
+   }
+
+   exchange();
+   return root;
+}
+
+Pipeline::Pipeline(PipelineConsumer &consumer, int threads, size_t capacity, bool ordered, SplitMode split) :
+   m_consumer(consumer),
+   m_threads(threads > 0 ? threads : std::max(1, (int)std::thread::hardware_concurrency())),
+   m_ordered(ordered),
+   m_split(split),
+   m_freeQueue(capacity + m_threads + 1),
+   m_parseQueue(capacity + m_threads + 1),
+   m_resultQueue(capacity + m_threads + 1),
+   m_abort(false),
+   m_sleepers(0),
+   m_events(0)
+{
+   if (capacity < 1)
+      capacity = 1;
+
+   m_items.reserve(capacity);
+   for (size_t i = 0; i < capacity; ++i)
+   {
+      m_items.push_back(new Item());
+      m_freeQueue.tryPush(m_items.back());
+   }
+}
+
+Pipeline::~Pipeline()
+{
+   for (size_t i = 0; i < m_items.size(); ++i)
+      delete m_items[i];
+}
+
+template <class T> bool Pipeline::push(BoundedQueue<T> &queue, const T &value)
+{
+   if (!queue.tryPush(value) && !wait([&]() { return queue.tryPush(value); }))
+      return false;
+
+   notify();
+   return true;
+}
+
+template <class T> bool Pipeline::pop(BoundedQueue<T> &queue, T &value)
+{
+   if (!queue.tryPop(value) && !wait([&]() { return queue.tryPop(value); }))
+      return false;
+
+   notify();
+   return true;
+}
+
+// Blocks until retry() succeeds, returns false on abort
+template <class Retry> bool Pipeline::wait(Retry retry)
+{
+   std::unique_lock<std::mutex> lock(m_sleepLock);
+   while (!m_abort.load())
+   {
+      // announce the sleeper before the last retry, notify() either sees it or its item is found here
+      m_sleepers.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (retry())
+      {
+         m_sleepers.fetch_sub(1);
+         return true;
+      }
+
+      size_t events = m_events;
+      m_wake.wait(lock, [&]() { return m_events != events || m_abort.load(); });
+      m_sleepers.fetch_sub(1);
+
+      if (retry())
+         return true;
+   }
+   return false;
+}
+
+void Pipeline::notify()
+{
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (!m_sleepers.load(std::memory_order_relaxed))
+      return;
+
+   std::lock_guard<std::mutex> lock(m_sleepLock);
+   m_events++;
+   m_wake.notify_all();
+}
+
+void Pipeline::abort()
+{
+   m_abort.store(true);
+
+   std::lock_guard<std::mutex> lock(m_sleepLock);
+   m_events++;
+   m_wake.notify_all();
+}
+
+void Pipeline::run(std::istream &in, size_t chunkSize)
+{
+   m_stats = PipelineStats();
+   m_abort.store(false);
+
+   std::vector<PipelineStats> parseStats(m_threads);
+   std::vector<std::thread>   workers;
+   std::exception_ptr         failure;
+   std::mutex                 failureLock;
+
+   workers.push_back(std::thread([&]() {
+      try { read(in, chunkSize); }
+      catch (...) { std::lock_guard<std::mutex> lock(failureLock); failure = std::current_exception(); abort(); }
+   }));
+
+   for (int i = 0; i < m_threads; ++i)
+   {
+      PipelineStats *stats = &parseStats[i];
+      workers.push_back(std::thread([&, stats]() {
+         try { parse(*stats); }
+         catch (...) { std::lock_guard<std::mutex> lock(failureLock); failure = std::current_exception(); abort(); }
+      }));
+   }
+
+   try
+   {
+      std::map<size_t, Item *> pending;
+      size_t                   sequence = 0;
+      int                      finished = 0;
+      Item                    *item;
+
+      while (finished < m_threads && pop(m_resultQueue, item))
+      {
+         if (!item)
          {
-         case 'b':
-            value += '\b';
-            ptr = skip(ptr, 1);
-            break;
-         case 'f':
-            value += '\f';
-            ptr = skip(ptr, 1);
-            break;
-         case 'n':
-            value += '\n';
-            ptr = skip(ptr, 1);
-            break;
-         case 'r':
-            value += '\r';
-            ptr = skip(ptr, 1);
-            break;
-         case 't':
-            value += '\t';
-            ptr = skip(ptr, 1);
-            break;
-         case 'u':
-            {
-               ptr = skip(ptr, 1);
-
-               int unicode;
-               ptr = parse_unicode(unicode, ptr);
-
-               if ((unicode >= 0xDC00 && unicode <= 0xDFFF) || unicode == 0)	
-                  throw JsonError("bad unicode character");
-
-               if (unicode >= 0xD800 && unicode <= 0xDBFF )
-               {
-                  if (*ptr != '\\')
-                     throw JsonError("expected second unicode surrogate part");
-                  ptr = skip(ptr, 1);
-                  if (*ptr != 'u')
-                     throw JsonError("expected second unicode surrogate part");
-                  ptr = skip(ptr, 1);
-
-                  int unicode2;
-                  ptr = parse_unicode(unicode2, ptr);
-
-                  unicode = 0x10000 + (((unicode & 0x3FF) << 10) | (unicode2 & 0x3FF));
-               }
-
-               int len = 4;
-               if (unicode < 0x80)
-               {
-                  len = 1;
-                  value += unicode;
-               }
-               else if (unicode < 0x800)
-               {
-                  len = 2;
-                  value += 0xc0 | (unicode >> 6);
-               }
-               else if (unicode < 0x10000)
-               {
-                  len = 3;
-                  value += 0xe0 | (unicode >> 12);
-               }
-               else
-               {
-                  len = 4;
-                  value += 0xf0 | (unicode >> 18);
-               }
-
-               for (int i = len; i > 1; --i)
-               {
-                  int shift = (i - 2) * 6;
-                  value += 0x80 | ((unicode >> shift) & 0x3f);
-               }
-            }
-            break;
-         default:
-            value += *ptr;
-            ptr = skip(ptr, 1);
-            break;
+            finished++;
+            continue;
+         }
+
+         if (!m_ordered)
+         {
+            deliver(item);
+            continue;
+         }
+
+         pending[item->sequence] = item;
+         while (!pending.empty() && pending.begin()->first == sequence)
+         {
+            deliver(pending.begin()->second);
+            pending.erase(pending.begin());
+            sequence++;
+         }
+      }
+   }
+   catch (...)
+   {
+      std::lock_guard<std::mutex> lock(failureLock);
+      failure = std::current_exception();
+      abort();
+   }
+
+   for (size_t i = 0; i < workers.size(); ++i)
+      workers[i].join();
+
+   for (int i = 0; i < m_threads; ++i)
+   {
+      m_stats.parsed       += parseStats[i].parsed;
+      m_stats.failed       += parseStats[i].failed;
+      m_stats.parseSeconds += parseStats[i].parseSeconds;
+      m_stats.maxResultQueue = std::max(m_stats.maxResultQueue, parseStats[i].maxResultQueue);
+   }
+
+   Item *item;
+   while (m_freeQueue.tryPop(item) || m_parseQueue.tryPop(item) || m_resultQueue.tryPop(item))
+      ;
+   for (size_t i = 0; i < m_items.size(); ++i)
+      m_freeQueue.tryPush(m_items[i]);
+
+   if (failure)
+      std::rethrow_exception(failure);
+}
+
+void Pipeline::read(std::istream &in, size_t chunkSize)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   std::vector<char>                     chunk(chunkSize ? chunkSize : 1);
+   DocumentSplitter                      splitter(m_split);
+   std::string                           document;
+   size_t                                sequence = 0;
+   bool                                  done = false;
+
+   while (!done)
+   {
+      in.read(&chunk[0], chunk.size());
+      size_t count = (size_t)in.gcount();
+      m_stats.bytesRead += count;
+
+      if (count)
+         splitter.feed(&chunk[0], count);
+      if (!in)
+      {
+         splitter.finish();
+         done = true;
+      }
+
+      while (splitter.next(document))
+      {
+         Item *item;
+         if (!pop(m_freeQueue, item))
+            return;
+
+         item->sequence = sequence++;
+         item->text.swap(document);
+         if (!push(m_parseQueue, item))
+            return;
+
+         m_stats.documents++;
+         m_stats.maxParseQueue = std::max(m_stats.maxParseQueue, m_parseQueue.size());
+      }
+   }
+
+   m_stats.readSeconds = elapsed(start);
+
+   for (int i = 0; i < m_threads; ++i)
+   {
+      if (!push(m_parseQueue, (Item *)0))
+         return;
+   }
+}
+
+void Pipeline::parse(PipelineStats &stats)
+{
+   Item *item;
+   while (pop(m_parseQueue, item))
+   {
+      if (!item)
+      {
+         push(m_resultQueue, item);
+         return;
+      }
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      try
+      {
+         item->root.parse(item->text.data(), item->text.size());
+         item->failed = false;
+         stats.parsed++;
+      }
+      catch (JsonError &e)
+      {
+         item->failed = true;
+         item->error  = e.what();
+         stats.failed++;
+      }
+      stats.parseSeconds += elapsed(start);
+
+      if (!push(m_resultQueue, item))
+         return;
+      stats.maxResultQueue = std::max(stats.maxResultQueue, m_resultQueue.size());
+   }
+}
+
+void Pipeline::deliver(Item *item)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   if (item->failed)
+      m_consumer.failed(item->text, item->sequence, JsonError(item->error));
+   else
+      m_consumer.consume(item->root, item->sequence);
+
+   m_stats.consumed++;
+   m_stats.consumeSeconds += elapsed(start);
+
+   // free queue has room for every item
+   m_freeQueue.tryPush(item);
+   notify();
+}
+
+class TaskPool
+{
+public:
+   TaskPool(int threads, int grain);
+   ~TaskPool();
+
+   bool traverse(const Value &value, ParallelVisitor &visitor);
+
+private:
+   struct Group
+   {
+      std::atomic<size_t> pending;
+      std::atomic<size_t> stop;
+   };
+
+   struct Task
+   {
+      const Value     *first;
+      size_t           count;
+      ParallelVisitor *visitor;
+      Group           *group;
+      size_t           index;
+   };
+
+   struct Worker
+   {
+      std::mutex       lock;
+      std::deque<Task> tasks;
+      char             pad[64];
+   };
+
+   void work(size_t worker);
+   bool take(size_t worker, Task &task);
+   void execute(size_t worker, const Task &task);
+   void fail();
+
+   bool runValue(size_t worker, const Value &value, ParallelVisitor &visitor);
+   bool runContainer(size_t worker, const Value &value, ParallelVisitor &visitor);
+   void runRange(size_t worker, const Task &task);
+   void fork(size_t worker, const Value &value, ParallelVisitor &visitor);
+
+private:
+   size_t                   m_grain;
+   std::vector<Worker *>    m_workers;
+   std::vector<std::thread> m_threads;
+   std::mutex               m_sleepLock;
+   std::condition_variable  m_wake;
+   std::atomic<size_t>      m_queued;
+   bool                     m_shutdown;
+   std::atomic<bool>        m_running;
+   std::atomic<bool>        m_abort;
+   std::exception_ptr       m_failure;
+   std::mutex               m_failureLock;
+};
+
+TaskPool::TaskPool(int threads, int grain) : 
+   m_grain(grain > 1 ? grain : 2), 
+   m_queued(0), 
+   m_shutdown(false), 
+   m_running(false), 
+   m_abort(false)
+{
+   if (threads <= 0)
+      threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+   for (int i = 0; i < threads; ++i)
+      m_workers.push_back(new Worker());
+
+   // worker 0 is the thread which calls traverse()
+   for (int i = 1; i < threads; ++i)
+      m_threads.push_back(std::thread(&TaskPool::work, this, (size_t)i));
+}
+
+TaskPool::~TaskPool()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_sleepLock);
+      m_shutdown = true;
+   }
+   m_wake.notify_all();
+
+   for (size_t i = 0; i < m_threads.size(); ++i)
+      m_threads[i].join();
+   for (size_t i = 0; i < m_workers.size(); ++i)
+      delete m_workers[i];
+}
+
+bool TaskPool::traverse(const Value &value, ParallelVisitor &visitor)
+{
+   // worker 0 and the failure slot belong to the running traversal
+   if (m_running.exchange(true))
+      throw JsonError("parallel traversal is already running");
+
+   m_abort.store(false);
+   m_failure = std::exception_ptr();
+
+   bool result = true;
+   try
+   {
+      if (value.getType() != TypeRoot)
+         result = runValue(0, value, visitor);
+      else if (value.firstChild())
+         runValue(0, *value.firstChild(), visitor);
+   }
+   catch (...)
+   {
+      fail();
+   }
+
+   m_running.store(false);
+   if (m_failure)
+      std::rethrow_exception(m_failure);
+   return result;
+}
+
+void TaskPool::work(size_t worker)
+{
+   while (1)
+   {
+      Task task;
+      if (take(worker, task))
+      {
+         execute(worker, task);
+         continue;
+      }
+
+      std::unique_lock<std::mutex> lock(m_sleepLock);
+      m_wake.wait(lock, [this]() { return m_shutdown || m_queued.load() > 0; });
+      if (m_shutdown)
+         return;
+   }
+}
+
+bool TaskPool::take(size_t worker, Task &task)
+{
+   // own tasks are taken from the back (latest fork, hot in cache), other workers are robbed from the front
+   for (size_t i = 0; i < m_workers.size(); ++i)
+   {
+      Worker                     *victim = m_workers[(worker + i) % m_workers.size()];
+      std::lock_guard<std::mutex> lock(victim->lock);
+
+      if (victim->tasks.empty())
+         continue;
+
+      if (!i)
+      {
+         task = victim->tasks.back();
+         victim->tasks.pop_back();
+      }
+      else
+      {
+         task = victim->tasks.front();
+         victim->tasks.pop_front();
+      }
+
+      m_queued.fetch_sub(1);
+      return true;
+   }
+
+   return false;
+}
+
+void TaskPool::execute(size_t worker, const Task &task)
+{
+   try
+   {
+      runRange(worker, task);
+   }
+   catch (...)
+   {
+      fail();
+   }
+
+   // the forking thread may sleep until its last part is done
+   if (task.group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+   {
+      std::lock_guard<std::mutex> lock(m_sleepLock);
+      m_wake.notify_all();
+   }
+}
+
+void TaskPool::fail()
+{
+   std::lock_guard<std::mutex> lock(m_failureLock);
+   if (!m_failure)
+      m_failure = std::current_exception();
+   m_abort.store(true);
+}
+
+bool TaskPool::runValue(size_t worker, const Value &value, ParallelVisitor &visitor)
+{
+   if (m_abort.load(std::memory_order_relaxed))
+      return false;
+
+   switch (value.getType())
+   {
+      case TypeObject:
+      case TypeArray:
+         return runContainer(worker, value, visitor);
+
+      default:
+         return value.traverse(visitor);
+   }
+}
+
+bool TaskPool::runContainer(size_t worker, const Value &value, ParallelVisitor &visitor)
+{
+   if (visitor.enter(value))
+   {
+      if ((size_t)value.childCount() >= m_grain)
+         fork(worker, value, visitor);
+      else
+      {
+         const Value *it = value.firstChild();
+         while (it)
+         {
+            if (!runValue(worker, *it, visitor))
+               break;
+            it = it->nextSibling();
+         }
+      }
+   }
+
+   if (m_abort.load(std::memory_order_relaxed))
+      return false;
+   return visitor.exit(value);
+}
+
+void TaskPool::runRange(size_t worker, const Task &task)
+{
+   const Value *it = task.first;
+   for (size_t i = 0; i < task.count; ++i, it = it->nextSibling())
+   {
+      // an earlier part stopped the traversal, results of this part will be dropped
+      if (task.group->stop.load(std::memory_order_relaxed) < task.index)
+         return;
+
+      if (!runValue(worker, *it, *task.visitor))
+      {
+         size_t stop = task.group->stop.load();
+         while (task.index < stop && !task.group->stop.compare_exchange_weak(stop, task.index))
+            ;
+         return;
+      }
+   }
+}
+
+void TaskPool::fork(size_t worker, const Value &value, ParallelVisitor &visitor)
+{
+   size_t count = (size_t)value.childCount();
+   size_t parts = std::min((count + m_grain - 1) / m_grain, m_workers.size() * 4);
+   size_t size  = (count + parts - 1) / parts;
+
+   Group group;
+   group.pending.store(0);
+   group.stop.store((size_t)-1);
+
+   std::vector<ParallelVisitor *> visitors(1, &visitor);
+   std::vector<Task>              tasks;
+
+   try
+   {
+      const Value *it = value.firstChild();
+      for (size_t i = 0; i < count; i += size)
+      {
+         if (i)
+            visitors.push_back(visitor.split());
+
+         Task task = { it, std::min(size, count - i), visitors.back(), &group, tasks.size() };
+         tasks.push_back(task);
+
+         for (size_t skip = 0; skip < size && it; ++skip)
+            it = it->nextSibling();
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(m_workers[worker]->lock);
+         for (size_t i = tasks.size() - 1; i > 0; --i)
+         {
+            m_workers[worker]->tasks.push_back(tasks[i]);
+            group.pending.fetch_add(1);
          }
+      }
+      {
+         std::lock_guard<std::mutex> lock(m_sleepLock);
+         m_queued.fetch_add(tasks.size() - 1);
+      }
+      m_wake.notify_all();
 
-         start = ptr;
+      runRange(worker, tasks[0]);
+   }
+   catch (...)
+   {
+      fail();
+   }
+
+   // help with other tasks until all parts of this container are done, sleep while there is nothing to take
+   while (group.pending.load(std::memory_order_acquire))
+   {
+      Task task;
+      if (take(worker, task))
+      {
+         execute(worker, task);
+         continue;
       }
+
+      std::unique_lock<std::mutex> lock(m_sleepLock);
+      m_wake.wait(lock, [&]() { return !group.pending.load(std::memory_order_acquire) || m_queued.load() > 0; });
    }
 
-   if (ptr != start)
-      value.append(start, ptr - start);
+   try
+   {
+      for (size_t i = 1; i < visitors.size(); ++i)
+      {
+         if (!m_abort.load() && i <= group.stop.load())
+            visitor.merge(*visitors[i]);
+      }
+   }
+   catch (...)
+   {
+      fail();
+   }
 
-   if (0 == *ptr)
-      return ptr;
+   for (size_t i = 1; i < visitors.size(); ++i)
+      delete visitors[i];
+}
 
-   return skip(ptr, 1);
+ParallelTraversal::ParallelTraversal(int threads, int grain) : m_pool(new TaskPool(threads, grain))
+{
 }
 
-const char *Root::parse_unicode(int &value, const char *ptr)
+ParallelTraversal::~ParallelTraversal()
 {
-   value = 0;
+   delete m_pool;
+}
 
-   for (int i = 0; i < 4; ++i)
-   {
-      char hex = *ptr;
+bool ParallelTraversal::traverse(const Value &value, ParallelVisitor &visitor)
+{
+   return m_pool->traverse(value, visitor);
+}
 
-      if ((hex >= '0' && hex <= '9'))
-         value = (value << 4) + (hex - '0');
-      else if ((hex >= 'a' && hex <= 'f'))
-         value = (value << 4) + (hex - 'a' + 10);
-      else if ((hex >= 'A' && hex <= 'F'))
-         value = (value << 4) + (hex - 'A' + 10);
-      else
-         throw JsonError("bad escaped character");
+namespace {
 
-      ptr = skip(ptr, 1);
+class FootprintCounter : public Visitor
+{
+public:
+   FootprintCounter() : bytes(0) {}
+
+   bool enter(const Value &value)
+   {
+      bytes += (value.getType() == TypeObject ? sizeof(Object) : sizeof(Array)) + value.getNameStr().capacity();
+      return true;
    }
 
-   return ptr;
+   bool visit(const String &value) { bytes += sizeof(String) + value.getNameStr().capacity() + value.getValueStr().capacity(); return true; }
+   bool visit(const Number &value) { bytes += sizeof(Number) + value.getNameStr().capacity(); return true; }
+   bool visit(const Boolean &value) { bytes += sizeof(Boolean) + value.getNameStr().capacity(); return true; }
+   bool visit(const Null &value) { bytes += sizeof(Null) + value.getNameStr().capacity(); return true; }
+
+   size_t bytes;
+};
+
 }
 
-const Array &Root::getArray() const
+DocumentCache::DocumentCache(size_t capacity) : m_capacity(capacity)
 {
-   if (!m_firstChild || m_firstChild->getType() != TypeArray)
-      throw JsonError("value is not an array");
-
-   return m_firstChild->toArray();
+   m_stats.capacity = capacity;
 }
 
-const Object &Root::getObject() const
-{ 
-   if (!m_firstChild || m_firstChild->getType() != TypeObject)
-      throw JsonError("value is not an object");
+size_t DocumentCache::hash(const char *data, size_t length)
+{
+   // four independent lanes keep the multipliers busy, content is compared on hit anyway
+   const Uint64 prime   = ((Uint64)0x9E3779B9 << 32) | 0x7F4A7C15;
+   Uint64       lane[4] = { length, prime, ~(Uint64)length, prime << 1 };
+   Uint64       word;
 
-   return m_firstChild->toObject();
+   while (length >= 32)
+   {
+      for (int i = 0; i < 4; ++i)
+      {
+         memcpy(&word, data + i * 8, 8);
+         lane[i] = (lane[i] ^ word) * prime;
+         lane[i] ^= lane[i] >> 29;
+      }
+      data   += 32;
+      length -= 32;
+   }
+
+   Uint64 result = lane[0] ^ (lane[1] << 1) ^ (lane[2] << 2) ^ (lane[3] << 3);
+   while (length)
+   {
+      size_t size = length < 8 ? length : 8;
+      word = 0;
+      memcpy(&word, data, size);
+      result = (result ^ word) * prime;
+      result ^= result >> 29;
+      data   += size;
+      length -= size;
+   }
+
+   result = (result ^ (result >> 32)) * prime;
+   return (size_t)(result ^ (result >> 29));
 }
 
-Value *Root::linkValue(Value *value) 
+size_t DocumentCache::footprint(const Root &root)
 {
-   if (m_firstChild)
-      delete m_firstChild;
-   m_firstChild = value;
-   return value;
+   FootprintCounter counter;
+   root.traverse(counter);
+   return sizeof(Root) + counter.bytes;
 }
 
-Value &Root::setValue(Value &value)
+DocumentCache::EntryList::iterator DocumentCache::find(size_t hash, const char *json, size_t length)
 {
-   Value *newv = value.clone();
-   
-   if (m_firstChild)
-      delete m_firstChild;
-   m_firstChild = newv;
-   return *newv;
+   std::pair<EntryMap::iterator, EntryMap::iterator> range = m_index.equal_range(hash);
+   for (EntryMap::iterator it = range.first; it != range.second; ++it)
+   {
+      const std::string &text = it->second->text;
+      if (text.size() == length && !memcmp(text.data(), json, length))
+         return it->second;
+   }
+
+   return m_entries.end();
 }
 
-bool Printer::enter(const Value &value) 
+std::shared_ptr<const Root> DocumentCache::parse(const char *json, size_t length)
 {
-   if (value.previousSibling())
+   size_t key = hash(json, length);
+
    {
-      m_out << ',';
-      printLineBreak();
+      std::lock_guard<std::mutex> lock(m_lock);
+
+      EntryList::iterator entry = find(key, json, length);
+      if (entry != m_entries.end())
+      {
+         m_entries.splice(m_entries.begin(), m_entries, entry);
+         m_stats.hits++;
+         return entry->root;
+      }
+
+      m_stats.misses++;
    }
-   printIndent();
-   printName(value);
 
-   if (value.getType() == TypeArray)
-      m_out << '[';
-   else if (value.getType() == TypeObject)
-      m_out << '{';
+   // parse outside of the lock, the length bounds the text so embedded zeros and trailing data are errors
+   Entry created;
+   created.hash = key;
+   created.text.assign(json, length);
 
-   printLineBreak();
-   m_depth++;
+   std::shared_ptr<Root> root(new Root());
+   root->parse(created.text.data(), created.text.size());
 
-   return true; 
+   created.cost = created.text.capacity() + footprint(*root) + sizeof(Entry);
+   created.root = root;
+   if (created.cost > m_capacity)
+      return created.root;
+
+   // evicted documents are released after unlocking, destroying a tree can take a while
+   std::vector< std::shared_ptr<const Root> > evicted;
+   std::lock_guard<std::mutex>                lock(m_lock);
+
+   EntryList::iterator entry = find(key, json, length);
+   if (entry != m_entries.end())
+      return entry->root;
+
+   while (m_stats.bytes + created.cost > m_capacity)
+   {
+      Entry                                            &last  = m_entries.back();
+      std::pair<EntryMap::iterator, EntryMap::iterator> range = m_index.equal_range(last.hash);
+      for (EntryMap::iterator it = range.first; it != range.second; ++it)
+      {
+         if (&*it->second == &last)
+         {
+            m_index.erase(it);
+            break;
+         }
+      }
+
+      m_stats.bytes -= last.cost;
+      m_stats.entries--;
+      m_stats.evictions++;
+      evicted.push_back(last.root);
+      m_entries.pop_back();
+   }
+
+   m_entries.push_front(Entry());
+   m_entries.front().hash = key;
+   m_entries.front().cost = created.cost;
+   m_entries.front().text.swap(created.text);
+   m_entries.front().root.swap(created.root);
+   m_index.insert(std::make_pair(key, m_entries.begin()));
+
+   m_stats.bytes += created.cost;
+   m_stats.entries++;
+   return m_entries.front().root;
 }
 
-bool Printer::visit(const Boolean &value) 
+void DocumentCache::clear()
 {
-   printSeparator(value);
-   printName(value);
-
-   if (value.getValue())
-      m_out << "true";
-   else
-      m_out << "false";
+   EntryList released;
+   {
+      std::lock_guard<std::mutex> lock(m_lock);
+      released.swap(m_entries);
+      m_index.clear();
+      m_stats.bytes   = 0;
+      m_stats.entries = 0;
+   }
+}
 
-   return true; 
+DocumentCacheStats DocumentCache::stats() const
+{
+   std::lock_guard<std::mutex> lock(m_lock);
+   return m_stats;
 }
 
-bool Printer::visit(const Null &value) 
+namespace {
+
+thread_local size_t t_threadId = 0;
+
+// Unique for the process lifetime, unlike thread_local addresses which a new thread may reuse
+size_t currentThread()
 {
-   printSeparator(value);
-   printName(value);
-   m_out << "null";
-   return true;
+   static std::atomic<size_t> next(1);
+   if (!t_threadId)
+      t_threadId = next.fetch_add(1, std::memory_order_relaxed);
+   return t_threadId;
+}
 }
 
-bool Printer::visit(const String &value)
+// Snapshots of one document taken by one thread. The owner counts its own snapshots without atomics, snapshots 
+// released by other threads are counted separately. After the owner exits the record lives until the last of its 
+// snapshots is released.
+class HeldSnapshots
 {
-   printSeparator(value);
-   printName(value);
-   printEscapedString(value.getValueStr());
+public:
+   HeldSnapshots(const SharedDocument *document) 
+      : document(document), m_owner(currentThread()), m_taken(0), m_takenAtExit(0), m_remote(0) {}
 
-   return true;
+   // owner thread only
+   size_t held() const { return m_taken - m_remote.load(std::memory_order_acquire); }
+   void   retain() { m_taken++; }
+
+   void release()
+   {
+      if (m_owner == currentThread())
+      {
+         m_taken--;
+         return;
+      }
+
+      size_t remote = m_remote.fetch_add(1, std::memory_order_acq_rel) + 1;
+      if ((remote & Abandoned) && (remote & ~Abandoned) == m_takenAtExit)
+         delete this;
+   }
+
+   // owner thread exits
+   void abandon()
+   {
+      // a remote release may delete the record as soon as the flag is set, compare against a copy
+      size_t taken  = m_taken;
+      m_takenAtExit = taken;
+      if (m_remote.fetch_add(Abandoned, std::memory_order_acq_rel) == taken)
+         delete this;
+   }
+
+   const SharedDocument *document;    // owner thread only
+
+private:
+   static const size_t Abandoned = ~((size_t)-1 >> 1);
+
+   size_t              m_owner;
+   size_t              m_taken;
+   size_t              m_takenAtExit;
+   std::atomic<size_t> m_remote;
+};
+
+namespace {
+
+thread_local HeldSnapshots *t_lastHeld = 0;    // plain pointer, read() of the same document skips the list
+
+struct HeldSnapshotsList
+{
+   ~HeldSnapshotsList()
+   {
+      for (size_t i = 0; i < entries.size(); ++i)
+         entries[i]->abandon();
+      t_lastHeld = 0;
+   }
+
+   std::vector<HeldSnapshots *> entries;
+};
+
+thread_local HeldSnapshotsList t_heldSnapshots;
+
+HeldSnapshots *heldSnapshots(const SharedDocument *document, bool create)
+{
+   if (t_lastHeld && t_lastHeld->document == document)
+      return t_lastHeld;
+
+   std::vector<HeldSnapshots *> &entries = t_heldSnapshots.entries;
+   HeldSnapshots                *unused  = 0;
+
+   for (size_t i = 0; i < entries.size(); ++i)
+   {
+      if (entries[i]->document == document)
+         return t_lastHeld = entries[i];
+      if (!unused && !entries[i]->held())
+         unused = entries[i];
+   }
+
+   if (!create)
+      return 0;
+
+   // entries without snapshots are reused, the list stays as long as the number of documents read at once
+   if (unused)
+   {
+      unused->document = document;
+      return t_lastHeld = unused;
+   }
+
+   entries.push_back(new HeldSnapshots(document));
+   return t_lastHeld = entries.back();
+}
 }
 
-bool Printer::visit(const Number &value)
+SharedDocument::Snapshot::~Snapshot()
 {
-   printSeparator(value);
-   printName(value);
-   m_out << std::setprecision(std::numeric_limits<double>::digits10 + 1) << value.getValue();
+   if (m_readers && m_readers->fetch_sub(1) == 1)
+      m_document->wake();
+   if (m_held)
+      m_held->release();
+}
 
-   return true;
+SharedDocument::SharedDocument(Root *root) : m_current(root), m_epoch(0), m_waiting(false)
+{
 }
 
-bool Printer::exit(const Value &value) 
+SharedDocument::~SharedDocument()
 {
-   m_depth--;
-   printLineBreak();
-   printIndent();
+   delete m_current.load();
+}
 
-   if (value.getType() == TypeArray)
-      m_out << ']';
-   else if (value.getType() == TypeObject)
-      m_out << '}';
+#if !defined(__cpp_aligned_new)
 
-   return true; 
+void *SharedDocument::operator new(size_t size)
+{
+   // allocated block address is kept right before the aligned object
+   const size_t align = alignof(SharedDocument);
+   char        *block = static_cast<char *>(::operator new(size + align + sizeof(void *)));
+   char        *ptr   = block + sizeof(void *);
+   ptr += (align - (size_t)ptr % align) % align;
+
+   reinterpret_cast<void **>(ptr)[-1] = block;
+   return ptr;
 }
 
-void Printer::printEscapedString(const std::string &value)
+void SharedDocument::operator delete(void *ptr)
 {
-   m_out << '\"';
+   if (ptr)
+      ::operator delete(static_cast<void **>(ptr)[-1]);
+}
 
-   const char *str = value.c_str();
-   const char *ptr = str;
+#endif
 
-   while (*ptr)
+size_t SharedDocument::stripe()
+{
+   static std::atomic<size_t> next(0);
+   static thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % Stripes;
+   return index;
+}
+
+void SharedDocument::drain(size_t parity)
+{
+   std::unique_lock<std::mutex> lock(m_drainLock);
+   for (int i = 0; i < Stripes; ++i)
    {
-      if ((unsigned char)*ptr > 31 && *ptr != '\"' && *ptr != '\\')
-         ptr++;
-      else
-      {
-         if (ptr != str)
-            m_out.write(str, ptr - str);
-         
-         switch (*ptr)
-         {
-         case '\\':
-            m_out << "\\\\";
-            break;
-         case '\"':
-            m_out << "\\\"";
-            break;
-         case '\b':
-            m_out << "\\b";
-            break;
-         case '\f':
-            m_out << "\\f";
-            break;
-         case '\n':
-            m_out << "\\n";
-            break;
-         case '\r':
-            m_out << "\\r";
-            break;
-         case '\t':
-            m_out << "\\t";
-            break;
-         default:
-            const char *hex = {"0123456789abcdef"};
-            m_out << "\\u00";
-            m_out << hex[(unsigned char)*ptr >> 4];
-            m_out << hex[(unsigned char)*ptr & 0x0f];
-            break;
-         }
+      while (m_readers[parity][i].count.load())
+         m_drained.wait(lock);
+   }
+}
 
-         str = ++ptr;
-      }
+// Called by the reader which brought a counter to zero. The publisher sets m_waiting before it checks the counters 
+// and the reader decrements before it checks m_waiting, so at least one of them sees the other.
+void SharedDocument::wake() const
+{
+   if (m_waiting.load())
+   {
+      std::lock_guard<std::mutex> lock(m_drainLock);
+      m_drained.notify_all();
    }
+}
 
-   if (ptr != str)
-      m_out.write(str, ptr - str);
-   
-   m_out << '\"';
+SharedDocument::Snapshot SharedDocument::read() const
+{
+   HeldSnapshots *held = heldSnapshots(this, true);
+   held->retain();
+
+   std::atomic<size_t> *readers = &m_readers[m_epoch.load() & 1][stripe()].count;
+   readers->fetch_add(1);
+   return Snapshot(this, m_current.load(), readers, held);
+}
+
+void SharedDocument::publish(Root *root)
+{
+   std::unique_ptr<Root> safe(root);
+
+   HeldSnapshots *held = heldSnapshots(this, false);
+   if (held && held->held())
+      throw JsonError("publish() called while the thread holds a snapshot");
+
+   std::lock_guard<std::mutex> lock(m_publish);
+
+   Root *old = m_current.exchange(safe.release());
+
+   // a reader may have taken the epoch before the previous flip and counted itself after it, 
+   // so both counters are drained, each one after new readers were switched to the other
+   m_waiting.store(true);
+   for (int i = 0; i < 2; ++i)
+      drain(m_epoch.fetch_add(1) & 1);
+   m_waiting.store(false);
+
+   if (old)
+      Reclaimer::release(old);
+}
+
+void SharedDocument::publish(const char *json)
+{
+   std::unique_ptr<Root> root(new Root());
+   root->parse(json);
+   publish(root.release());
 }
 
-};
\ No newline at end of file
+#endif
+
+}
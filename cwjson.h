@@ -29,13 +29,57 @@
 #include <string>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 #include <iomanip>
 #include <limits>
 #include <memory>
 #include <math.h>
 
+#ifndef CWJSON_THREADS
+#  if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#     define CWJSON_THREADS 1
+#  else
+#     define CWJSON_THREADS 0
+#  endif
+#endif
+
+#ifndef CWJSON_CONSTEXPR
+#  if __cplusplus >= 201402L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201402L)
+#     define CWJSON_CONSTEXPR 1
+#  else
+#     define CWJSON_CONSTEXPR 0
+#  endif
+#endif
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#if !defined(_MSC_VER) || _MSC_VER >= 1600
+#include <stdint.h>
+#endif
+
+#if CWJSON_THREADS
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <exception>
+#endif
+
 namespace cwjson {
 
+// 64-bit file offsets and hashes, stdint.h is missing from MSVC before 2010
+#if defined(_MSC_VER) && _MSC_VER < 1600
+typedef unsigned __int64 Uint64;
+#else
+typedef uint64_t Uint64;
+#endif
+
 enum ValueType
 {
    TypeRoot,
@@ -47,6 +91,26 @@ enum ValueType
    TypeNull
 };
 
+enum DuplicateMode
+{
+   DuplicateKeep,
+   DuplicateReject,
+   DuplicateLast
+};
+
+enum Encoding
+{
+   EncodingUtf8,
+   EncodingUtf16LE,
+   EncodingUtf16BE
+};
+
+enum SplitMode
+{
+   SplitValues,
+   SplitLines
+};
+
 class JsonError : public std::runtime_error
 {
 public:
@@ -67,6 +131,36 @@ class Number;
 class String;
 class Boolean;
 class Null;
+class KeyIndex;
+class TaskPool;
+class IncrementalParser;
+class HeldSnapshots;
+
+class Reclaimer
+{
+public:
+   static void   release(Value *value);
+   static void   flush();
+   static size_t pending();
+};
+
+class NodePool
+{
+public:
+   static void *allocate(size_t size);
+   static void  release(void *ptr, size_t size);
+   static void  reserve(size_t size, size_t count);
+   static void  trim();
+
+   enum
+   {
+      Granularity = 16,
+      Classes     = 16,
+      Limit       = 16384,
+      Batch       = 256,
+      DepotLimit  = 64
+   };
+};
 
 class Visitor
 {
@@ -82,19 +176,75 @@ public:
    virtual bool exit(const Value &value) { return true; }
 };
 
+struct PathSegment
+{
+   const std::string *name;
+   int                index;
+};
+
+class Path
+{
+   friend class PathTraversal;
+
+public:
+   size_t             size() const { return m_segments.size(); }
+   const PathSegment &operator[](size_t i) const { return m_segments[i]; }
+   void               toPointer(std::string &out) const;
+
+private:
+   std::vector<PathSegment> m_segments;
+};
+
+class PathVisitor
+{
+public:
+   virtual ~PathVisitor() {}
+
+   virtual bool enter(const Value &value, const Path &path) { return true; }
+   virtual bool visit(const String &value, const Path &path) { return true; }
+   virtual bool visit(const Number &value, const Path &path) { return true; }
+   virtual bool visit(const Boolean &value, const Path &path) { return true; }
+   virtual bool visit(const Null &value, const Path &path) { return true; }
+   virtual bool exit(const Value &value, const Path &path) { return true; }
+};
+
+class Transformer
+{
+public:
+   virtual ~Transformer() {}
+
+   virtual Value *enter(Value &value) { return &value; }
+   virtual Value *visit(String &value);
+   virtual Value *visit(Number &value);
+   virtual Value *visit(Boolean &value);
+   virtual Value *visit(Null &value);
+   virtual Value *exit(Value &value) { return &value; }
+};
+
 class Value
 {
    friend class Root;
+   friend class IncrementalParser;
    friend class Array;
    friend class Object;
 
 public:
-   Value() : m_parent(0), m_firstChild(0), m_lastChild(0), m_prev(0), m_next(0), m_length(0) { }
+   Value() : m_parent(0), m_firstChild(0), m_lastChild(0), m_prev(0), m_next(0), m_length(0), m_nameEscape(false) { }
    virtual ~Value() 
    {
-      Value *it = m_firstChild;
+      // grandchildren are moved to the end of the list before the child is deleted, 
+      // so destruction doesn't recurse and deep trees can't overflow the stack
+      Value *it   = m_firstChild;
+      Value *tail = m_lastChild;
       while (it)
       {
+         if (it->m_firstChild)
+         {
+            tail->m_next     = it->m_firstChild;
+            tail             = it->m_lastChild;
+            it->m_firstChild = it->m_lastChild = 0;
+         }
+
          Value *next = it->m_next;
          delete it;
          it = next;
@@ -102,21 +252,23 @@ public:
    }
 
 protected:
-   Value(std::string &name) : m_parent(0), m_firstChild(0), m_lastChild(0), m_prev(0), m_next(0), m_length(0) { m_name.swap(name); }
+   Value(std::string &name) : m_parent(0), m_firstChild(0), m_lastChild(0), m_prev(0), m_next(0), m_length(0), m_nameEscape(false) { m_name.swap(name); }
    void   insertValueInt(Value *value);
    void   insertValueBeforeInt(Value *before, Value *value);
    Value *swapValueInt(Value *value);
    Value *removeValueInt(Value *value);
-   void   swapName(std::string &name) { m_name.swap(name); }
+   void   swapName(std::string &name);
 
 public:
    virtual ValueType    getType() const = 0;
    const std::string   &getNameStr() const { return m_name; }
    const char          *getName() const { return m_name.c_str(); }
-   void                 setName(std::string &name) { m_name = name; }
-   void                 setName(const char *name) { m_name = name; }
+   void                 setName(std::string &name);
+   void                 setName(const char *name);
+   bool                 needsNameEscaping() const { return m_nameEscape; }
    bool                 isNull() const;
    int                  childCount() const { return m_length; }
+   Value               *detach();
 
    const Value   *parent() const { return m_parent; }
    Value         *firstChild() { return m_firstChild; }
@@ -143,6 +295,9 @@ public:
    virtual bool   traverse(Visitor &visitor) const = 0;
    virtual Value *clone() const = 0;
 
+   static void *operator new(size_t size) { return NodePool::allocate(size); }
+   static void  operator delete(void *ptr, size_t size) { NodePool::release(ptr, size); }
+
 private:
    Value(const Value &);
    void operator=(const Value &);
@@ -154,6 +309,7 @@ protected:
    Value *m_prev;
    Value *m_next;
    int    m_length;
+   bool   m_nameEscape;
 
    std::string m_name;
 };
@@ -161,6 +317,7 @@ protected:
 class Number : public Value
 {
    friend class Root;
+   friend class IncrementalParser;
 
 public:
    Number(double value) : m_value(value) {}
@@ -185,34 +342,40 @@ private:
 class String : public Value
 {
    friend class Root;
+   friend class IncrementalParser;
 
 public:
-   String(const std::string &value) : m_value(value) { }
-   String(const char *value) : m_value(value) { }
+   String(const std::string &value);
+   String(const char *value);
 
    virtual ~String() {}
 
    ValueType          getType() const { return TypeString; }
    const std::string &getValueStr() const { return m_value; }
    const char        *getValue() const { return m_value.c_str(); }
-   void               setValue(const std::string &value) { m_value = value; }
-   void               setValue(const char *value) { m_value = value; } 
+   void               setValue(const std::string &value);
+   void               setValue(const char *value);
+   bool               needsEscaping() const { return m_escape; }
+   void               getBinary(std::string &value, bool lenient = false) const;
+   void               setBinary(const void *data, size_t size);
    String            &toString() { return *this; }
    const String      &toString() const { return *this; }
 
    bool    traverse(Visitor &visitor) const { return visitor.visit(*this); }
-   String *clone() const { return new String(m_value); }
+   String *clone() const;
 
 private:
-   String(std::string &name, std::string &value) : Value(name) { m_value.swap(value); }
+   String(std::string &name, std::string &value, bool escape) : Value(name), m_escape(escape) { m_value.swap(value); }
 
 private:
    std::string m_value;
+   bool        m_escape;
 };
 
 class Boolean : public Value
 {
    friend class Root;
+   friend class IncrementalParser;
 
 public:
    Boolean(bool value) : m_value(value) {}
@@ -237,6 +400,7 @@ private:
 class Null : public Value
 {
    friend class Root;
+   friend class IncrementalParser;
 
 public:
    Null() {}
@@ -254,16 +418,18 @@ private:
 class Object : public Value
 {
    friend class Root;
+   friend class IncrementalParser;
+   friend class Value;
 
 public:
-   Object() {}
-   virtual ~Object() {}
+   Object() : m_lookup(0) {}
+   virtual ~Object() { delete m_lookup; }
 
    ValueType     getType() const { return TypeObject; }
    Object       &toObject() { return *this; }
    const Object &toObject() const { return *this; }
    
-   Value         &getValue(const char *name) { return const_cast<Value &>((const_cast<const Object *>(this))->getValue(name)); }
+   Value         &getValue(const char *name);
    const Value   &getValue(const char *name) const;
    Object        &getObject(const char *name) { return getValue(name).toObject(); }
    const Object  &getObject(const char *name) const { return getValue(name).toObject(); }
@@ -315,6 +481,10 @@ public:
 
    void           removeValue(const char *name);
    void           removeValue(const std::string &name) { removeValue(name.c_str()); }
+   void           moveMembersFrom(Object &other, bool replace = false);
+
+   void           setAdaptiveLookup(bool enable);
+   bool           isAdaptiveLookup() const { return m_lookup != 0; }
 
    bool traverse(Visitor &visitor) const
    {
@@ -334,15 +504,18 @@ public:
    Object *clone() const;
 
 private:
-   Object(std::string &name) : Value(name) {}
+   Object(std::string &name) : Value(name), m_lookup(0) {}
    void linkValueSafe(const char *name, Value *value);
+   void lookupReplace(Value *oldValue, Value *newValue);
 
 private:
+   std::vector<Value *> *m_lookup;
 };
 
 class Array : public Value
 {
    friend class Root;
+   friend class IncrementalParser;
 
 public:
    Array() {}
@@ -399,6 +572,13 @@ public:
    void           setNull(int position, bool value) { linkValueSafe(new Null(), position, 2); }
 
    void           removeValue(int position);
+   void           spliceBack(Array &other);
+
+   template <class Compare>   void sort(Compare less);
+   template <class Predicate> int  removeIf(Predicate pred);
+   template <class Predicate> int  partition(Predicate pred);
+   template <class Equal>     int  unique(Equal equal);
+   void                            reverse();
 
    bool traverse(Visitor &visitor) const
    {
@@ -421,8 +601,164 @@ private:
    Array(std::string &name) : Value(name) {}
    Value *linkValueInt(Value *value, int position, int where);
    Value *linkValueSafe(Value *value, int position, int where);
+   void   appendChain(Value *chain);
+   void   relinkValues(const std::vector<Value *> &values);
+
+   template <class Compare>
+   struct ValueLess
+   {
+      ValueLess(Compare less) : less(less) {}
+      bool operator()(const Value *a, const Value *b) { return less(*a, *b); }
+
+      Compare less;
+   };
+
+private:
+};
+
+template <class Compare>
+void Array::sort(Compare less)
+{
+   if (m_length < 2)
+      return;
+
+   // merging the list itself chases pointers on every pass, sorting a pointer array and 
+   // relinking once is several times faster and leaves the array unchanged if less() throws
+   std::vector<Value *> values;
+   values.reserve(m_length);
+   for (Value *it = m_firstChild; it; it = it->m_next)
+      values.push_back(it);
+
+   std::stable_sort(values.begin(), values.end(), ValueLess<Compare>(less));
+   relinkValues(values);
+}
+
+// Elements are deleted as they are visited, if pred() throws the ones removed so far stay removed and the 
+// rest of the array is unchanged
+template <class Predicate>
+int Array::removeIf(Predicate pred)
+{
+   int    removed = 0;
+   Value *it      = m_firstChild;
+   while (it)
+   {
+      Value *next = it->m_next;
+      if (pred(*it))
+      {
+         delete removeValueInt(it);
+         ++removed;
+      }
+      it = next;
+   }
+
+   return removed;
+}
+
+template <class Predicate>
+int Array::partition(Predicate pred)
+{
+   int     count    = 0;
+   Value  *rejected = 0;
+   Value **tail     = &rejected;
+   Value  *it       = m_firstChild;
+
+   try
+   {
+      while (it)
+      {
+         Value *next = it->m_next;
+         if (pred(*it))
+            ++count;
+         else
+         {
+            removeValueInt(it);
+            it->m_next = 0;
+            *tail      = it;
+            tail       = &it->m_next;
+         }
+         it = next;
+      }
+   }
+   catch (...)
+   {
+      appendChain(rejected);
+      throw;
+   }
+
+   appendChain(rejected);
+   return count;
+}
+
+// Same as removeIf(), duplicates found before equal() throws stay removed
+template <class Equal>
+int Array::unique(Equal equal)
+{
+   if (!m_firstChild)
+      return 0;
+
+   int    removed = 0;
+   Value *kept    = m_firstChild;
+   Value *it      = kept->m_next;
+   while (it)
+   {
+      Value *next = it->m_next;
+      if (equal(*kept, *it))
+      {
+         delete removeValueInt(it);
+         ++removed;
+      }
+      else
+         kept = it;
+      it = next;
+   }
+
+   return removed;
+}
+
+class PathTraversal : private Visitor
+{
+public:
+   PathTraversal() : m_visitor(0) {}
+
+   bool traverse(const Value &value, PathVisitor &visitor);
+
+private:
+   bool enter(const Value &value);
+   bool visit(const String &value);
+   bool visit(const Number &value);
+   bool visit(const Boolean &value);
+   bool visit(const Null &value);
+   bool exit(const Value &value);
+
+   void push(const Value &value)
+   {
+      if (m_counters.empty())
+         return;
+
+      PathSegment segment;
+      segment.name  = value.parent()->getType() == TypeObject ? &value.getNameStr() : 0;
+      segment.index = m_counters.back()++;
+      m_path.m_segments.push_back(segment);
+   }
+
+   void pop()
+   {
+      if (!m_counters.empty())
+         m_path.m_segments.pop_back();
+   }
+
+   template <class T> bool leaf(const T &value)
+   {
+      push(value);
+      bool result = m_visitor->visit(value, m_path);
+      pop();
+      return result;
+   }
 
 private:
+   PathVisitor     *m_visitor;
+   Path             m_path;
+   std::vector<int> m_counters;
 };
 
 class Printer : public Visitor
@@ -444,13 +780,30 @@ public:
       m_tab       = tab;
    }
 
-private:
    void printEscapedString(const std::string &value);
+   void printString(const std::string &value, bool escape)
+   {
+      if (escape)
+         return printEscapedString(value);
+
+      m_out << '\"';
+      m_out.write(value.data(), value.size());
+      m_out << '\"';
+   }
+   void printBase64(const char *data, size_t size);
+   void printNumber(double value)
+   {
+      m_out << std::setprecision(std::numeric_limits<double>::digits10 + 1) << value;
+   }
+
+   static bool needsEscaping(const char *str, size_t size);
+
+protected:
    void printName(const Value &value)
    {
       if (value.parent() && value.parent()->getType() == TypeObject)
       {
-         printEscapedString(value.getNameStr());
+         printString(value.getNameStr(), value.needsNameEscaping());
          if (m_format)
             m_out << " : ";
          else
@@ -483,7 +836,7 @@ private:
       printIndent();
    }
 
-private:
+protected:
    std::ostream &m_out;
    int           m_depth;
    bool          m_format;
@@ -491,12 +844,355 @@ private:
    std::string   m_lineBreak;
 };
 
+struct CompactFormat
+{
+   void indent(std::ostream &out, int depth) const {}
+   void lineBreak(std::ostream &out) const {}
+   void colon(std::ostream &out) const { out.put(':'); }
+};
+
+template <int Width = 3>
+struct PrettyFormat
+{
+   void indent(std::ostream &out, int depth) const
+   {
+      static const char spaces[] = "                                                                ";
+
+      size_t size = (size_t)depth * Width;
+      while (size)
+      {
+         size_t part = std::min(size, sizeof(spaces) - 1);
+         out.write(spaces, part);
+         size -= part;
+      }
+   }
+
+   void lineBreak(std::ostream &out) const { out.put('\n'); }
+   void colon(std::ostream &out) const { out.write(" : ", 3); }
+};
+
+class CustomFormat
+{
+public:
+   CustomFormat(const char *tab, const char *lineBreak) : m_tab(tab), m_lineBreak(lineBreak) {}
+
+   void indent(std::ostream &out, int depth) const
+   {
+      size_t size = (size_t)depth * m_tab.size();
+      while (m_indent.size() < size)
+         m_indent += m_tab;
+      out.write(m_indent.data(), size);
+   }
+
+   void lineBreak(std::ostream &out) const { out.write(m_lineBreak.data(), m_lineBreak.size()); }
+   void colon(std::ostream &out) const { out.write(" : ", 3); }
+
+private:
+   std::string         m_tab;
+   std::string         m_lineBreak;
+   mutable std::string m_indent;
+};
+
+// Policy printer. Structure and separators are written by the format policy, scalars by a plain Printer on the 
+// same stream, so none of the runtime formatting state of Printer is carried along.
+template <class Format>
+class FormatPrinter : public Visitor
+{
+public:
+   FormatPrinter(std::ostream &out, const Format &format = Format()) : m_out(out), m_depth(0), m_policy(format), m_text(out) {}
+
+   bool enter(const Value &value)
+   {
+      printSeparator(value);
+      printName(value);
+
+      if (value.getType() == TypeArray)
+         m_out.put('[');
+      else if (value.getType() == TypeObject)
+         m_out.put('{');
+
+      m_policy.lineBreak(m_out);
+      m_depth++;
+      return true;
+   }
+
+   bool visit(const Boolean &value)
+   {
+      printSeparator(value);
+      printName(value);
+      if (value.getValue())
+         m_out.write("true", 4);
+      else
+         m_out.write("false", 5);
+      return true;
+   }
+
+   bool visit(const String &value)
+   {
+      printSeparator(value);
+      printName(value);
+      m_text.printString(value.getValueStr(), value.needsEscaping());
+      return true;
+   }
+
+   bool visit(const Number &value)
+   {
+      printSeparator(value);
+      printName(value);
+      m_text.printNumber(value.getValue());
+      return true;
+   }
+
+   bool visit(const Null &value)
+   {
+      printSeparator(value);
+      printName(value);
+      m_out.write("null", 4);
+      return true;
+   }
+
+   bool exit(const Value &value)
+   {
+      m_depth--;
+      m_policy.lineBreak(m_out);
+      m_policy.indent(m_out, m_depth);
+
+      if (value.getType() == TypeArray)
+         m_out.put(']');
+      else if (value.getType() == TypeObject)
+         m_out.put('}');
+      return true;
+   }
+
+   void printEscapedString(const std::string &value) { m_text.printEscapedString(value); }
+   void printString(const std::string &value, bool escape) { m_text.printString(value, escape); }
+   void printBase64(const char *data, size_t size) { m_text.printBase64(data, size); }
+   void printNumber(double value) { m_text.printNumber(value); }
+
+protected:
+   void printName(const Value &value)
+   {
+      if (value.parent() && value.parent()->getType() == TypeObject)
+      {
+         m_text.printString(value.getNameStr(), value.needsNameEscaping());
+         m_policy.colon(m_out);
+      }
+   }
+
+   void printSeparator(const Value &value)
+   {
+      if (value.previousSibling())
+      {
+         m_out.put(',');
+         m_policy.lineBreak(m_out);
+      }
+      m_policy.indent(m_out, m_depth);
+   }
+
+protected:
+   std::ostream &m_out;
+   int           m_depth;
+   Format        m_policy;
+
+private:
+   Printer       m_text;
+};
+
+struct PreviewLimits
+{
+   PreviewLimits(size_t bytes = 2048, int depth = 8, int elements = 32, size_t stringLength = 128) : 
+      bytes(bytes), depth(depth), elements(elements), stringLength(stringLength) {}
+
+   size_t bytes;
+   int    depth;
+   int    elements;
+   size_t stringLength;
+};
+
+class PreviewPrinter : public Visitor
+{
+public:
+   PreviewPrinter(std::string &out, const PreviewLimits &limits = PreviewLimits());
+
+   bool enter(const Value &value);
+   bool visit(const Boolean &value);
+   bool visit(const String &value);
+   bool visit(const Number &value);
+   bool visit(const Null &value);
+   bool exit(const Value &value);
+
+   bool isTruncated() const { return m_truncated; }
+
+private:
+   struct Level
+   {
+      int  count;
+      bool shown;
+   };
+
+   bool begin(const Value &value);
+   void printString(const std::string &value, bool escape);
+   bool check();
+
+private:
+   std::string        &m_out;
+   size_t              m_start;
+   PreviewLimits       m_limits;
+   std::vector<Level>  m_levels;
+   bool                m_done;
+   bool                m_truncated;
+   std::ostringstream  m_scratch;
+   Printer             m_printer;
+};
+
+struct Segment
+{
+   const char *data;
+   size_t      size;
+};
+
+class GatherBuffer : public std::streambuf
+{
+public:
+   GatherBuffer() : m_mark(0), m_out(this) {}
+
+   std::ostream &stream() { return m_out; }
+   void          reference(const char *data, size_t size);
+   void          clear();
+
+   const std::vector<Segment> &segments();
+   size_t                      size() const;
+
+   template <class IOV> size_t fillIovec(IOV *iov, size_t count)
+   {
+      const std::vector<Segment> &list = segments();
+      size_t                      i    = 0;
+
+      for (; i < list.size() && i < count; ++i)
+      {
+         iov[i].iov_base = (void *)list[i].data;
+         iov[i].iov_len  = list[i].size;
+      }
+      return i;
+   }
+
+protected:
+   int_type        overflow(int_type c);
+   std::streamsize xsputn(const char *str, std::streamsize count);
+
+private:
+   struct Piece
+   {
+      const char *external;
+      size_t      offset;
+      size_t      size;
+   };
+
+   void closeScratch();
+
+private:
+   std::string          m_scratch;
+   std::vector<Piece>   m_pieces;
+   std::vector<Segment> m_segments;
+   size_t               m_mark;
+   std::ostream         m_out;
+};
+
+// Long strings which don't need escaping are referenced in the buffer instead of copied
+template <class Format = CompactFormat>
+class GatherPrinter : public FormatPrinter<Format>
+{
+public:
+   GatherPrinter(GatherBuffer &buffer, size_t threshold = 4096, const Format &format = Format()) 
+      : FormatPrinter<Format>(buffer.stream(), format), m_buffer(buffer), m_threshold(threshold) {}
+
+   bool visit(const String &value)
+   {
+      const std::string &str = value.getValueStr();
+      if (str.size() < m_threshold || value.needsEscaping())
+         return FormatPrinter<Format>::visit(value);
+
+      this->printSeparator(value);
+      this->printName(value);
+      this->m_out.put('\"');
+      m_buffer.reference(str.data(), str.size());
+      this->m_out.put('\"');
+      return true;
+   }
+
+   using FormatPrinter<Format>::visit;
+
+private:
+   GatherBuffer &m_buffer;
+   size_t        m_threshold;
+};
+
+class StringSink
+{
+public:
+   virtual ~StringSink() {}
+
+   virtual void append(const char *data, size_t size) = 0;
+};
+
+class Scanner
+{
+public:
+   static const char *whitespace(const char *ptr)
+   {
+      while (*ptr == 0x20 || *ptr == 0x09 || *ptr == 0x0A || *ptr == 0x0D) 
+         ++ptr; 
+      return ptr; 
+   }
+
+   static const char *skip(const char *ptr, size_t count)
+   {
+      return ptr + count;
+   }
+
+   static bool isDigit(char digit)
+   {
+      if (digit >= '0' && digit <= '9')
+         return true;
+      return false;
+   }
+
+   static const char *parseNumber(double &value, const char *ptr);
+   static const char *parseString(std::string &value, const char *ptr);
+   static const char *parseString(std::string &value, bool &escape, const char *ptr);
+
+   // bounded input, end is one past the last character and nothing is read from it
+   static const char *whitespace(const char *ptr, const char *end);
+   static const char *parseNumber(double &value, const char *ptr, const char *end);
+   static const char *parseString(std::string &value, bool &escape, const char *ptr, const char *end);
+
+   static const char *parseString(StringSink &sink, const char *ptr, size_t chunkSize = 1 << 16);
+   static const char *parseEscape(char *value, size_t &length, const char *ptr);
+   static const char *parseUnicode(int &value, const char *ptr);
+   static const char *parseKey(const char *&key, size_t &length, std::string &scratch, const char *ptr);
+   static const char *skipString(const char *ptr);
+   static const char *skipValue(const char *ptr);
+   static const char *parseBase64(std::string &value, const char *ptr, bool lenient = false);
+   static void        decodeBase64(std::string &value, const char *data, size_t length, bool lenient = false);
+   static void        encodeBase64(std::string &value, const char *data, size_t length);
+};
+
+class Utf16
+{
+public:
+   static void toUtf8(std::string &out, const char *data, size_t size, bool bigEndian = false);
+   static void fromUtf8(std::string &out, const char *data, size_t size, bool bigEndian = false);
+};
+
+bool        equalJson(const char *a, size_t lengthA, const char *b, size_t lengthB);
+inline bool equalJson(const std::string &a, const std::string &b) { return equalJson(a.data(), a.size(), b.data(), b.size()); }
+
 class Root : public Value
 {
 public:
-   Root() {}
-   Root(const char *json) { parse(json); }
-   Root(std::string &json) { parse(json.c_str()); }
+   Root() : m_duplicates(DuplicateKeep) {}
+   Root(const char *json) : m_duplicates(DuplicateKeep) { parse(json); }
+   Root(std::string &json) : m_duplicates(DuplicateKeep) { parse(json.c_str()); }
 
    virtual ~Root() {}
 
@@ -516,47 +1212,738 @@ public:
 
    void parse(const char *json);
    void parse(std::string &json) { parse(json.c_str()); }
+   void parse(const char *json, size_t length);
+   void parseUtf16(const char *data, size_t size);
+   void clear();
+   void releaseAsync();
+   void setDuplicateMode(DuplicateMode mode) { m_duplicates = mode; }
+   DuplicateMode getDuplicateMode() const { return m_duplicates; }
    bool traverse(Visitor &visitor) const
    {
       if (m_firstChild)
          m_firstChild->traverse(visitor);
       return true;
    }
+   void transform(Transformer &transformer);
 
    void print(std::ostream &out, bool format = false)
    {
-      Printer printer(out);
-      printer.setFormating(format, "   ", "\n");
+      if (format)
+      {
+         FormatPrinter< PrettyFormat<> > printer(out);
+         traverse(printer);
+      }
+      else
+      {
+         FormatPrinter<CompactFormat> printer(out);
+         traverse(printer);
+      }
+   }
 
-      traverse(printer);
+   void printUtf16(std::ostream &out, bool format = false, bool bigEndian = false);
+
+   void print(GatherBuffer &out, bool format = false, size_t threshold = 4096)
+   {
+      if (format)
+      {
+         GatherPrinter< PrettyFormat<> > printer(out, threshold);
+         traverse(printer);
+      }
+      else
+      {
+         GatherPrinter<CompactFormat> printer(out, threshold);
+         traverse(printer);
+      }
    }
 
 private:
-   const char *whitespace(const char *ptr) const
+   void replaceTransformed(Value *value, Value *result);
+
+private:
+   DuplicateMode m_duplicates;
+};
+
+class IncrementalParser
+{
+   friend class ParserPool;
+
+public:
+   IncrementalParser(Root &root, const char *json);
+   IncrementalParser(Root &root, const char *data, size_t size, Encoding encoding = EncodingUtf8);
+   ~IncrementalParser();
+
+   bool   step(size_t budget);
+   bool   isDone() const { return m_state == StateDone; }
+   size_t offset() const { return m_ptr - m_start; }
+
+private:
+   IncrementalParser(const IncrementalParser &);
+   void operator=(const IncrementalParser &);
+
+   enum State
    {
-      while (*ptr == 0x20 || *ptr == 0x09 || *ptr == 0x0A || *ptr == 0x0D) 
-         ++ptr; 
-      return ptr; 
+      StateValue,
+      StateKey,
+      StateNext,
+      StateDone
+   };
+
+   void push(Value *container);
+   void link(Value *parent, Value *value);
+
+   template <class Input> bool        run(size_t budget, const Input &input);
+   template <class Input> const char *parseValue(const char *ptr, const Input &input);
+   template <class Input> const char *parseKey(const char *ptr, const Input &input);
+   template <class Input> const char *parseNext(const char *ptr, const Input &input);
+
+private:
+   Root                   &m_root;
+   const char             *m_start;
+   const char             *m_ptr;
+   const char             *m_end;
+   Encoding                m_encoding;
+   State                   m_state;
+   DuplicateMode           m_duplicates;
+   std::string             m_name;
+   bool                    m_nameEscape;
+   std::vector<Value *>    m_stack;
+   std::vector<KeyIndex *> m_keys;
+};
+
+#if CWJSON_CONSTEXPR
+
+// Compile-time syntax check only, CWJSON_LITERAL still parses the text at run time on first use
+class Literal
+{
+public:
+   static constexpr bool check(const char *json)
+   {
+      size_t pos = value(json, whitespace(json, 0));
+      return pos != error() && json[whitespace(json, pos)] == 0;
    }
 
-   const char *skip(const char *ptr, size_t count) const
+private:
+   static constexpr size_t error() { return (size_t)-1; }
+
+   static constexpr size_t whitespace(const char *json, size_t pos)
    {
-      return ptr + count;
+      while (json[pos] == 0x20 || json[pos] == 0x09 || json[pos] == 0x0A || json[pos] == 0x0D)
+         ++pos;
+      return pos;
    }
 
-   bool isDigit(char digit) const
+   static constexpr bool isDigit(char digit)
    {
-      if (digit >= '0' && digit <= '9')
-         return true;
-      return false;
+      return digit >= '0' && digit <= '9';
+   }
+
+   static constexpr int hex(char digit)
+   {
+      return (digit >= '0' && digit <= '9') ? digit - '0' : 
+             (digit >= 'a' && digit <= 'f') ? digit - 'a' + 10 : 
+             (digit >= 'A' && digit <= 'F') ? digit - 'A' + 10 : -1;
+   }
+
+   static constexpr size_t word(const char *json, size_t pos, const char *word)
+   {
+      size_t i = 0;
+      for (; word[i]; ++i)
+      {
+         if (json[pos + i] != word[i])
+            return error();
+      }
+      return pos + i;
+   }
+
+   static constexpr size_t unicode(const char *json, size_t pos, int &code)
+   {
+      code = 0;
+      for (int i = 0; i < 4; ++i)
+      {
+         int digit = hex(json[pos + i]);
+         if (digit < 0)
+            return error();
+         code = (code << 4) + digit;
+      }
+      return pos + 4;
+   }
+
+   static constexpr size_t string(const char *json, size_t pos)
+   {
+      ++pos;
+      while (json[pos] != '"')
+      {
+         if (json[pos] == 0 || (unsigned char)json[pos] < 0x20)
+            return error();
+
+         if (json[pos] != '\\')
+         {
+            ++pos;
+            continue;
+         }
+
+         ++pos;
+         switch (json[pos])
+         {
+         case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+            ++pos;
+            break;
+         case 'u':
+            {
+               int code = 0;
+               pos = unicode(json, pos + 1, code);
+               if (pos == error() || code == 0 || (code >= 0xDC00 && code <= 0xDFFF))
+                  return error();
+
+               if (code >= 0xD800 && code <= 0xDBFF)
+               {
+                  if (json[pos] != '\\' || json[pos + 1] != 'u')
+                     return error();
+                  pos = unicode(json, pos + 2, code);
+                  if (pos == error())
+                     return error();
+               }
+            }
+            break;
+         default:
+            return error();
+         }
+      }
+      return pos + 1;
+   }
+
+   static constexpr size_t number(const char *json, size_t pos)
+   {
+      if (json[pos] == '-')
+         ++pos;
+
+      if (json[pos] == '0')
+      {
+         if (isDigit(json[++pos]))
+            return error();
+      }
+      else if (isDigit(json[pos]))
+      {
+         while (isDigit(json[pos]))
+            ++pos;
+      }
+      else
+         return error();
+
+      if (json[pos] == '.')
+      {
+         if (!isDigit(json[++pos]))
+            return error();
+         while (isDigit(json[pos]))
+            ++pos;
+      }
+
+      if (json[pos] == 'e' || json[pos] == 'E')
+      {
+         ++pos;
+         if (json[pos] == '-' || json[pos] == '+')
+            ++pos;
+         if (!isDigit(json[pos]))
+            return error();
+         while (isDigit(json[pos]))
+            ++pos;
+      }
+
+      return pos;
+   }
+
+   static constexpr size_t value(const char *json, size_t pos)
+   {
+      switch (json[pos])
+      {
+      case '{':
+         pos = whitespace(json, pos + 1);
+         if (json[pos] == '}')
+            return pos + 1;
+
+         while (1)
+         {
+            if (json[pos] != '"')
+               return error();
+            pos = string(json, pos);
+            if (pos == error())
+               return error();
+
+            pos = whitespace(json, pos);
+            if (json[pos] != ':')
+               return error();
+
+            pos = value(json, whitespace(json, pos + 1));
+            if (pos == error())
+               return error();
+
+            pos = whitespace(json, pos);
+            if (json[pos] == '}')
+               return pos + 1;
+            if (json[pos] != ',')
+               return error();
+            pos = whitespace(json, pos + 1);
+         }
+      case '[':
+         pos = whitespace(json, pos + 1);
+         if (json[pos] == ']')
+            return pos + 1;
+
+         while (1)
+         {
+            pos = value(json, pos);
+            if (pos == error())
+               return error();
+
+            pos = whitespace(json, pos);
+            if (json[pos] == ']')
+               return pos + 1;
+            if (json[pos] != ',')
+               return error();
+            pos = whitespace(json, pos + 1);
+         }
+      case '"':
+         return string(json, pos);
+      case 't':
+         return word(json, pos, "true");
+      case 'f':
+         return word(json, pos, "false");
+      case 'n':
+         return word(json, pos, "null");
+      default:
+         return number(json, pos);
+      }
+   }
+};
+
+#define CWJSON_LITERAL(json) \
+   ([]() -> const cwjson::Root & \
+   { \
+      static_assert(cwjson::Literal::check(json), "invalid JSON literal"); \
+      static const cwjson::Root root(json); \
+      return root; \
+   }())
+
+#endif
+
+class RecordIndex
+{
+public:
+   RecordIndex() : m_fileSize(0), m_probe(0) {}
+
+   void build(const char *data, size_t size, int threads = 1);
+   bool build(FILE *file);
+   bool save(const char *path) const;
+   bool load(const char *path);
+   bool matches(FILE *file) const;
+
+   size_t size() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+   Uint64 offset(size_t i) const { return m_offsets[i]; }
+   size_t length(size_t i) const { return (size_t)(m_offsets[i + 1] - m_offsets[i]); }
+   Uint64 fileSize() const { return m_fileSize; }
+
+   void record(const char *data, size_t i, Root &root) const;
+   void record(FILE *file, size_t i, Root &root) const;
+
+private:
+   void addLines(const char *data, size_t size, const std::vector<size_t> &newlines, Uint64 base, Uint64 &start, bool &content);
+
+private:
+   std::vector<Uint64> m_offsets;
+   Uint64              m_fileSize;
+   Uint64              m_probe;       // hash of the first and last bytes of the data, checked by matches()
+};
+
+// SplitValues cuts concatenated values by bracket depth, an unbalanced bracket swallows the rest of the stream into 
+// one malformed document. SplitLines (NDJSON) cuts at every newline and skips blank lines, a malformed line stays alone.
+class DocumentSplitter
+{
+public:
+   DocumentSplitter(SplitMode mode = SplitValues) 
+      : m_mode(mode), m_depth(0), m_inString(false), m_escape(false), m_inScalar(false), m_started(false) {}
+
+   void   feed(const char *data, size_t size);
+   void   finish();
+   bool   next(std::string &document);
+   size_t pending() const { return m_documents.size(); }
+
+private:
+   void feedLines(const char *data, size_t size);
+   void emit();
+   void emitLine();
+
+private:
+   SplitMode               m_mode;
+   std::deque<std::string> m_documents;
+   std::string             m_current;
+   int                     m_depth;
+   bool                    m_inString;
+   bool                    m_escape;
+   bool                    m_inScalar;
+   bool                    m_started;
+};
+
+#if CWJSON_THREADS
+
+// Roots and parser stacks are cached per thread, acquire() and parse() on a warm thread don't allocate
+class ParserPool
+{
+public:
+   ParserPool() {}
+
+   Root *acquire();
+   void  release(Root *root);
+   void  reserve(size_t nodes);
+
+   Root *parse(const char *json);
+   Root *parse(const std::string &json) { return parse(json.c_str()); }
+
+   enum
+   {
+      Limit = 64
+   };
+
+private:
+   ParserPool(const ParserPool &);
+   void operator=(const ParserPool &);
+};
+
+template <class T>
+class BoundedQueue
+{
+public:
+   BoundedQueue(size_t capacity) : m_cells(0), m_mask(0), m_enqueue(0), m_dequeue(0)
+   {
+      size_t size = 2;
+      while (size < capacity)
+         size <<= 1;
+
+      m_cells = new Cell[size];
+      m_mask  = size - 1;
+      for (size_t i = 0; i < size; ++i)
+         m_cells[i].sequence.store(i, std::memory_order_relaxed);
+   }
+
+   ~BoundedQueue() { delete [] m_cells; }
+
+   bool tryPush(const T &value)
+   {
+      size_t pos = m_enqueue.load(std::memory_order_relaxed);
+      while (1)
+      {
+         Cell     *cell = &m_cells[pos & m_mask];
+         size_t    seq  = cell->sequence.load(std::memory_order_acquire);
+         ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+
+         if (diff == 0)
+         {
+            if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+               cell->value = value;
+               cell->sequence.store(pos + 1, std::memory_order_release);
+               return true;
+            }
+         }
+         else if (diff < 0)
+            return false;
+         else
+            pos = m_enqueue.load(std::memory_order_relaxed);
+      }
+   }
+
+   bool tryPop(T &value)
+   {
+      size_t pos = m_dequeue.load(std::memory_order_relaxed);
+      while (1)
+      {
+         Cell     *cell = &m_cells[pos & m_mask];
+         size_t    seq  = cell->sequence.load(std::memory_order_acquire);
+         ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+
+         if (diff == 0)
+         {
+            if (m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+               value = cell->value;
+               cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+               return true;
+            }
+         }
+         else if (diff < 0)
+            return false;
+         else
+            pos = m_dequeue.load(std::memory_order_relaxed);
+      }
+   }
+
+   size_t size() const
+   {
+      size_t enqueue = m_enqueue.load(std::memory_order_relaxed);
+      size_t dequeue = m_dequeue.load(std::memory_order_relaxed);
+      return enqueue > dequeue ? enqueue - dequeue : 0;
    }
 
-   const char *parse_value(Value *parent, std::string &name, const char *ptr);
-   const char *parse_number(double &value, const char *ptr);
-   const char *parse_string(std::string &value, const char *ptr);
-   const char *parse_unicode(int &value, const char *ptr);
+   size_t capacity() const { return m_mask + 1; }
+
+private:
+   BoundedQueue(const BoundedQueue &);
+   void operator=(const BoundedQueue &);
+
+   struct Cell
+   {
+      std::atomic<size_t> sequence;
+      T                   value;
+   };
+
+private:
+   Cell                *m_cells;
+   size_t               m_mask;
+   char                 m_pad1[64];
+   std::atomic<size_t>  m_enqueue;
+   char                 m_pad2[64];
+   std::atomic<size_t>  m_dequeue;
+};
+
+class PipelineConsumer
+{
+public:
+   virtual ~PipelineConsumer() {}
+
+   virtual void consume(Root &root, size_t sequence) = 0;
+   virtual void failed(const std::string &document, size_t sequence, const JsonError &error) {}
+};
+
+struct PipelineStats
+{
+   PipelineStats() : bytesRead(0), documents(0), parsed(0), failed(0), consumed(0), 
+                     readSeconds(0), parseSeconds(0), consumeSeconds(0), maxParseQueue(0), maxResultQueue(0) {}
+
+   size_t bytesRead;
+   size_t documents;
+   size_t parsed;
+   size_t failed;
+   size_t consumed;
+   double readSeconds;
+   double parseSeconds;
+   double consumeSeconds;
+   size_t maxParseQueue;
+   size_t maxResultQueue;
+};
+
+class Pipeline
+{
+public:
+   Pipeline(PipelineConsumer &consumer, int threads = 0, size_t capacity = 256, bool ordered = false, SplitMode split = SplitValues);
+   ~Pipeline();
+
+   void run(std::istream &in, size_t chunkSize = 1 << 16);
+
+   const PipelineStats &stats() const { return m_stats; }
+   size_t               parseQueueDepth() const { return m_parseQueue.size(); }
+   size_t               resultQueueDepth() const { return m_resultQueue.size(); }
+
+private:
+   Pipeline(const Pipeline &);
+   void operator=(const Pipeline &);
+
+   struct Item
+   {
+      Item() : sequence(0), failed(false) {}
+
+      size_t      sequence;
+      std::string text;
+      Root        root;
+      bool        failed;
+      std::string error;
+   };
+
+   template <class T> bool push(BoundedQueue<T> &queue, const T &value);
+   template <class T> bool pop(BoundedQueue<T> &queue, T &value);
+   template <class Retry> bool wait(Retry retry);
+
+   void notify();
+   void abort();
+   void read(std::istream &in, size_t chunkSize);
+   void parse(PipelineStats &stats);
+   void deliver(Item *item);
+
+private:
+   PipelineConsumer    &m_consumer;
+   int                  m_threads;
+   bool                 m_ordered;
+   SplitMode            m_split;
+   std::vector<Item *>  m_items;
+   BoundedQueue<Item *> m_freeQueue;
+   BoundedQueue<Item *> m_parseQueue;
+   BoundedQueue<Item *> m_resultQueue;
+   std::atomic<bool>    m_abort;
+   PipelineStats        m_stats;
+
+   // eventcount: threads blocked on a full or empty queue sleep until another stage moves an item
+   std::mutex              m_sleepLock;
+   std::condition_variable m_wake;
+   std::atomic<size_t>     m_sleepers;
+   size_t                  m_events;
+};
+
+class ParallelVisitor : public Visitor
+{
+public:
+   virtual ParallelVisitor *split() = 0;
+   virtual void             merge(ParallelVisitor &part) {}
+};
+
+class ParallelTraversal
+{
+public:
+   ParallelTraversal(int threads = 0, int grain = 1024);
+   ~ParallelTraversal();
+
+   // One traversal at a time, throws JsonError if called while another one runs (also from inside a visitor)
+   bool traverse(const Value &value, ParallelVisitor &visitor);
+
+private:
+   ParallelTraversal(const ParallelTraversal &);
+   void operator=(const ParallelTraversal &);
+
+private:
+   TaskPool *m_pool;
+};
+
+struct DocumentCacheStats
+{
+   DocumentCacheStats() : hits(0), misses(0), evictions(0), entries(0), bytes(0), capacity(0) {}
+
+   size_t hits;
+   size_t misses;
+   size_t evictions;
+   size_t entries;
+   size_t bytes;
+   size_t capacity;
+};
+
+class DocumentCache
+{
+public:
+   DocumentCache(size_t capacity = 64 << 20);
+
+   std::shared_ptr<const Root> parse(const char *json, size_t length);
+   std::shared_ptr<const Root> parse(const std::string &json) { return parse(json.data(), json.size()); }
+
+   void               clear();
+   DocumentCacheStats stats() const;
+
+   static size_t hash(const char *data, size_t length);
+   static size_t footprint(const Root &root);
+
+private:
+   DocumentCache(const DocumentCache &);
+   void operator=(const DocumentCache &);
+
+   struct Entry
+   {
+      size_t                      hash;
+      size_t                      cost;
+      std::string                 text;
+      std::shared_ptr<const Root> root;
+   };
+
+   typedef std::list<Entry>                                   EntryList;
+   typedef std::unordered_multimap<size_t, EntryList::iterator> EntryMap;
+
+   EntryList::iterator find(size_t hash, const char *json, size_t length);
+
+private:
+   mutable std::mutex m_lock;
+   size_t             m_capacity;
+   EntryList          m_entries;
+   EntryMap           m_index;
+   DocumentCacheStats m_stats;
+};
+
+class SharedDocument
+{
+public:
+   class Snapshot
+   {
+      friend class SharedDocument;
+
+   public:
+      Snapshot(Snapshot &&other) 
+         : m_document(other.m_document), m_root(other.m_root), m_readers(other.m_readers), m_held(other.m_held)
+      {
+         other.m_readers = 0;
+         other.m_held    = 0;
+      }
+      ~Snapshot();
+
+      const Root *get() const { return m_root; }
+      const Root &operator*() const { return *m_root; }
+      const Root *operator->() const { return m_root; }
+
+   private:
+      Snapshot(const SharedDocument *document, const Root *root, std::atomic<size_t> *readers, HeldSnapshots *held) 
+         : m_document(document), m_root(root), m_readers(readers), m_held(held) {}
+      Snapshot(const Snapshot &);
+      void operator=(const Snapshot &);
+
+   private:
+      const SharedDocument *m_document;
+      const Root           *m_root;
+      std::atomic<size_t>  *m_readers;
+      HeldSnapshots        *m_held;
+   };
+
+   SharedDocument(Root *root = 0);
+   ~SharedDocument();
+
+#if !defined(__cpp_aligned_new)
+   // new before C++17 ignores the cache line alignment of the members
+   static void *operator new(size_t size);
+   static void  operator delete(void *ptr);
+#endif
+
+   // The first read() of a document on a thread allocates a small per-thread record, later reads don't allocate
+   Snapshot read() const;
+
+   // Throws JsonError if the calling thread still holds a Snapshot of this document, waiting for it would never end
+   void publish(Root *root);
+   void publish(const char *json);
+   void publish(const std::string &json) { publish(json.c_str()); }
+
+private:
+   SharedDocument(const SharedDocument &);
+   void operator=(const SharedDocument &);
+
+   enum
+   {
+      Stripes = 16
+   };
+
+   // one cache line per counter, readers on different stripes don't share lines
+   struct alignas(64) Readers
+   {
+      Readers() : count(0) {}
+
+      std::atomic<size_t> count;
+   };
+
+   static size_t stripe();
+   void          drain(size_t parity);
+   void          wake() const;
+
+private:
+   std::atomic<Root *>              m_current;
+   alignas(64) std::atomic<size_t>  m_epoch;
+   std::atomic<bool>                m_waiting;
+   mutable Readers                  m_readers[2][Stripes];
+   std::mutex                       m_publish;
+   mutable std::mutex               m_drainLock;
+   mutable std::condition_variable  m_drained;
 };
 
+#endif
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1009 @@
+/*
+   Copyright (c) 2012 Sergej Kravcenko
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/*
+   cwjsontest - tests for parser, transcoders, record index and the threaded components. Exits with 1 if any
+   check fails. Threaded tests are also meant to run under -fsanitize=thread, the others under -fsanitize=address.
+
+   Usage: cwjsontest [test-prefix...]
+
+   Needs C++11: g++ -std=c++11 -O1 -g tests/cwjsontest.cpp cwjson.cpp -o cwjsontest -lpthread
+*/
+
+#include "../cwjson.h"
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+int g_failures;
+
+void fail(const char *file, int line, const char *text)
+{
+   printf("  %s:%d: %s\n", file, line, text);
+   g_failures++;
+}
+
+#define CHECK(expr) \
+   do { if (!(expr)) fail(__FILE__, __LINE__, #expr); } while (0)
+
+#define CHECK_THROWS(stmt) \
+   do { try { stmt; fail(__FILE__, __LINE__, "no exception: " #stmt); } catch (cwjson::JsonError &) {} } while (0)
+
+std::string compact(const cwjson::Value &value)
+{
+   std::ostringstream                       out;
+   cwjson::FormatPrinter<cwjson::CompactFormat> printer(out);
+   value.traverse(printer);
+   return out.str();
+}
+
+std::string compact(const char *json)
+{
+   cwjson::Root root(json);
+   return compact(root);
+}
+
+std::string utf16(const std::string &utf8, bool bigEndian = false)
+{
+   std::string out;
+   cwjson::Utf16::fromUtf8(out, utf8.data(), utf8.size(), bigEndian);
+   return out;
+}
+
+const char *document =
+   "{\"name\":\"caf\\u00e9 \xE2\x82\xAC \\ud83d\\ude00\",\"list\":[1,-2.5,3e2,true,false,null,[],{}],"
+   " \"nested\" : { \"a\" : [ { \"b\" : \"\\\"q\\\"\\n\" } ] }, \"empty\":\"\", \"last\":0}";
+
+// IncrementalParser
+
+// Every step budget must give the same tree, whatever character the parser stops at
+void incrementalBudgets()
+{
+   std::string expected = compact(document);
+   std::string text     = document;
+   std::string wide     = utf16(text);
+
+   for (size_t budget = 1; budget < 20; ++budget)
+   {
+      cwjson::Root                 root;
+      cwjson::IncrementalParser parser(root, text.c_str());
+      while (!parser.step(budget))
+         ;
+      CHECK(compact(root) == expected);
+      CHECK(parser.offset() <= text.size());
+
+      cwjson::Root              bounded;
+      cwjson::IncrementalParser boundedParser(bounded, text.data(), text.size());
+      while (!boundedParser.step(budget))
+         ;
+      CHECK(compact(bounded) == expected);
+
+      cwjson::Root              wideRoot;
+      cwjson::IncrementalParser wideParser(wideRoot, wide.data(), wide.size(), cwjson::EncodingUtf16LE);
+      while (!wideParser.step(budget))
+         ;
+      CHECK(compact(wideRoot) == expected);
+   }
+}
+
+void incrementalErrors()
+{
+   const char *broken[] = { "[1,2", "{\"a\" 1}", "{\"a\":1,}", "[tru]", "01", "1.", "1e", "{1:2}" };
+
+   for (size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); ++i)
+   {
+      cwjson::Root              root;
+      cwjson::IncrementalParser parser(root, broken[i]);
+      CHECK_THROWS(while (!parser.step(1)) ;);
+   }
+}
+
+// Input with a length rejects strings cut off by the length and data after the value
+void incrementalStrict()
+{
+   const char *bad[] = { "\"abc", "[\"ab", "{\"ab", "[1] x", "\"abc\"x", "12 3", "{} {}" };
+   for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+   {
+      cwjson::Root root;
+      CHECK_THROWS(root.parse(bad[i], strlen(bad[i])));
+
+      std::string wide = utf16(bad[i]);
+      CHECK_THROWS(root.parseUtf16(wide.data(), wide.size()));
+   }
+
+   cwjson::Root root;
+   CHECK_THROWS(root.parse("\"abc\"", 3));
+
+   root.parse("[1] \r\n\t ", 8);
+   CHECK(compact(root) == "[1]");
+   root.parse("\"abc\" trailing", 5);
+   CHECK(compact(root) == "\"abc\"");
+
+   // zero terminated text keeps the lenient behaviour
+   root.parse("[1] x");
+   CHECK(compact(root) == "[1]");
+}
+
+// UTF-16 and UTF-8 transcoding
+
+void utf16Surrogates()
+{
+   // U+1F600 as a surrogate pair, in both byte orders and from both directions
+   std::string smile = "\"\xF0\x9F\x98\x80\"";
+   for (int bigEndian = 0; bigEndian < 2; ++bigEndian)
+   {
+      std::string wide = utf16(smile, bigEndian != 0);
+      CHECK(wide.size() == 8);
+
+      std::string back;
+      cwjson::Utf16::toUtf8(back, wide.data(), wide.size(), bigEndian != 0);
+      CHECK(back == smile);
+
+      cwjson::Root root;
+      root.parseUtf16(wide.data(), wide.size());
+      CHECK(compact(root) == smile);
+   }
+
+   // lone high, lone low, high followed by a non-surrogate, high at the end
+   const char *bad[] = { "\x3D\xD8\x41\x00", "\x00\xDE\x41\x00", "\x3D\xD8\x3D\xD8", "\x41\x00\x3D\xD8" };
+   for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+   {
+      std::string out;
+      CHECK_THROWS(cwjson::Utf16::toUtf8(out, bad[i], 4));
+
+      // same units inside a JSON string
+      std::string wide = std::string("\x22\x00", 2) + std::string(bad[i], 4) + std::string("\x22\x00", 2);
+      cwjson::Root root;
+      CHECK_THROWS(root.parseUtf16(wide.data(), wide.size()));
+   }
+
+   std::string odd("\x22\x00\x41", 3);
+   cwjson::Root root;
+   CHECK_THROWS(root.parseUtf16(odd.data(), odd.size()));
+}
+
+void utf8Overlong()
+{
+   // overlong '/', overlong U+0800 range, encoded surrogate, above U+10FFFF, truncated, stray continuation
+   const char *bad[] = { "\xC0\xAF", "\xC1\xBF", "\xE0\x80\xAF", "\xF0\x80\x80\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80",
+                         "\xE2\x82", "\x80", "\xF8\x88\x80\x80\x80" };
+   for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+   {
+      std::string out;
+      CHECK_THROWS(cwjson::Utf16::fromUtf8(out, bad[i], strlen(bad[i])));
+   }
+
+   // shortest forms at every length boundary are accepted
+   const char *good[] = { "\x7F", "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF" };
+   for (size_t i = 0; i < sizeof(good) / sizeof(good[0]); ++i)
+   {
+      std::string wide = utf16(good[i]);
+      std::string back;
+      cwjson::Utf16::toUtf8(back, wide.data(), wide.size());
+      CHECK(back == good[i]);
+   }
+}
+
+void utf16RoundTrip()
+{
+   cwjson::Root root(document);
+
+   for (int bigEndian = 0; bigEndian < 2; ++bigEndian)
+   {
+      std::ostringstream out;
+      root.printUtf16(out, false, bigEndian != 0);
+
+      std::string  wide = out.str();
+      cwjson::Root copy;
+      copy.parseUtf16(wide.data(), wide.size());
+      CHECK(compact(copy) == compact(root));
+   }
+}
+
+// GatherBuffer
+
+void gatherPrint()
+{
+   std::string  big(5000, 'x');
+   std::string  text = "{\"a\":[1,\"short\",{\"b\":\"" + big + "\",\"c\":\"\\n" + big + "\"}],\"n\":null}";
+   cwjson::Root root(text.c_str());
+
+   for (int format = 0; format < 2; ++format)
+   {
+      cwjson::GatherBuffer out;
+      root.print(out, format != 0, 4096);
+
+      std::string gathered;
+      size_t      referenced = 0;
+      for (size_t i = 0; i < out.segments().size(); ++i)
+      {
+         const cwjson::Segment &segment = out.segments()[i];
+         gathered.append(segment.data, segment.size);
+         if (segment.size == big.size())
+            referenced++;
+      }
+
+      std::ostringstream printed;
+      root.print(printed, format != 0);
+      CHECK(gathered == printed.str());
+      CHECK(out.size() == gathered.size());
+
+      // the clean long string is referenced, the one which needs escaping is copied
+      CHECK(referenced == 1);
+      CHECK(out.segments()[1].data == root.getObject().getArray("a").getObject(2).getString("b").getValueStr().data());
+   }
+}
+
+// Base64
+
+void base64Canonical()
+{
+   std::string value;
+
+   const char *good[]  = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy", "+/+/" };
+   const char *plain[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar", "\xFB\xFF\xBF" };
+   for (size_t i = 0; i < sizeof(good) / sizeof(good[0]); ++i)
+   {
+      cwjson::Scanner::decodeBase64(value, good[i], strlen(good[i]));
+      CHECK(value == plain[i]);
+
+      std::string encoded;
+      cwjson::Scanner::encodeBase64(encoded, value.data(), value.size());
+      CHECK(encoded == good[i]);
+   }
+
+   // missing or extra padding, non-zero unused bits, bad length and characters
+   const char *bad[] = { "Zg", "Zm8", "Zg=", "Zm9v=", "Zh==", "Zm9=", "Z", "Zm9vY", "Zm9v====", "Zm 9v", "Zm9*" };
+   for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+      CHECK_THROWS(cwjson::Scanner::decodeBase64(value, bad[i], strlen(bad[i])));
+
+   // lenient mode takes unpadded input and ignores unused bits
+   cwjson::Scanner::decodeBase64(value, "Zm8", 3, true);
+   CHECK(value == "fo");
+   cwjson::Scanner::decodeBase64(value, "Zh==", 4, true);
+   CHECK(value == "f");
+   CHECK_THROWS(cwjson::Scanner::decodeBase64(value, "Z", 1, true));
+
+   const char *json = "\"Zm9v\\/Yg==\"";
+   CHECK_THROWS(cwjson::Scanner::parseBase64(value, json));
+   CHECK(*cwjson::Scanner::parseBase64(value, "\"Zm9vYg==\",", true) == ',');
+   CHECK(value == "foob");
+
+   cwjson::Root root("{\"data\":\"Zm8\"}");
+   CHECK_THROWS(root.getObject().getString("data").getBinary(value));
+   root.getObject().getString("data").getBinary(value, true);
+   CHECK(value == "fo");
+}
+
+// RecordIndex
+
+void recordIndexSaveLoad()
+{
+   std::string text = "{\"i\":0}\n\n  \t\r\n{\"i\":1}\r\n   {\"i\":2}  \n \n{\"i\":3}";
+
+   cwjson::RecordIndex index;
+   index.build(text.data(), text.size());
+   CHECK(index.size() == 4);
+
+   FILE *data = tmpfile();
+   CHECK(data != 0);
+   if (!data)
+      return;
+   fwrite(text.data(), 1, text.size(), data);
+   fflush(data);
+
+   cwjson::RecordIndex fromFile;
+   CHECK(fromFile.build(data));
+   CHECK(fromFile.size() == index.size());
+
+   const char *path = "cwjsontest.idx";
+   CHECK(index.save(path));
+
+   cwjson::RecordIndex loaded;
+   CHECK(loaded.load(path));
+   CHECK(loaded.size() == index.size());
+   CHECK(loaded.matches(data));
+
+   for (size_t i = 0; i < loaded.size(); ++i)
+   {
+      CHECK(loaded.offset(i) == index.offset(i));
+
+      cwjson::Root fromBuffer, fromDisk;
+      loaded.record(text.data(), i, fromBuffer);
+      loaded.record(data, i, fromDisk);
+      CHECK(fromBuffer.getObject().getNumber("i").getValue() == (double)i);
+      CHECK(compact(fromDisk) == compact(fromBuffer));
+   }
+
+   cwjson::Root root;
+   CHECK_THROWS(loaded.record(text.data(), loaded.size(), root));
+
+   // same size, different content
+   fseek(data, 2, SEEK_SET);
+   fputc('j', data);
+   fflush(data);
+   CHECK(!loaded.matches(data));
+   fseek(data, 2, SEEK_SET);
+   fputc('i', data);
+   fflush(data);
+   CHECK(loaded.matches(data));
+
+   // index of a data file that has grown doesn't match any more
+   fseek(data, 0, SEEK_END);
+   fputs("\n{\"i\":4}\n", data);
+   fflush(data);
+   CHECK(!loaded.matches(data));
+   fclose(data);
+
+   FILE *broken = fopen(path, "wb");
+   fputs("not an index", broken);
+   fclose(broken);
+   CHECK(!loaded.load(path));
+   remove(path);
+}
+
+// DocumentSplitter
+
+void splitterChunks()
+{
+   const char *stream = "{\"a\":[1,{\"b\":\"}\"}]} [1,2]\n\"text \\\" ]\" 12 true\r\n{}";
+   const char *expected[] = { "{\"a\":[1,{\"b\":\"}\"}]}", "[1,2]", "\"text \\\" ]\"", "12", "true", "{}" };
+
+   for (size_t chunk = 1; chunk <= strlen(stream); ++chunk)
+   {
+      cwjson::DocumentSplitter splitter;
+      for (size_t pos = 0; pos < strlen(stream); pos += chunk)
+         splitter.feed(stream + pos, std::min(chunk, strlen(stream) - pos));
+      splitter.finish();
+
+      std::string document;
+      size_t      count = 0;
+      while (splitter.next(document))
+      {
+         CHECK(count < 6 && document == expected[count]);
+         count++;
+      }
+      CHECK(count == 6);
+   }
+}
+
+// a malformed line doesn't take its neighbours with it in line mode, value mode reports the rest as one document
+void splitterLines()
+{
+   const char *stream = "{\"i\":0}\n{\"i\":1,\n  \t\r\n\n[2]\r\n\"x\" \n{\"i\":4}";
+   const char *lines[] = { "{\"i\":0}", "{\"i\":1,", "[2]\r", "\"x\" ", "{\"i\":4}" };
+
+   for (size_t chunk = 1; chunk <= strlen(stream); ++chunk)
+   {
+      cwjson::DocumentSplitter splitter(cwjson::SplitLines);
+      for (size_t pos = 0; pos < strlen(stream); pos += chunk)
+         splitter.feed(stream + pos, std::min(chunk, strlen(stream) - pos));
+      splitter.finish();
+
+      std::string document;
+      size_t      count = 0;
+      while (splitter.next(document))
+      {
+         CHECK(count < 5 && document == lines[count]);
+         count++;
+      }
+      CHECK(count == 5);
+   }
+
+   cwjson::DocumentSplitter values;
+   values.feed(stream, strlen(stream));
+   values.finish();
+
+   std::string document;
+   CHECK(values.next(document) && document == "{\"i\":0}");
+   CHECK(values.next(document));
+   cwjson::Root root;
+   CHECK_THROWS(root.parse(document.data(), document.size()));
+   CHECK(!values.next(document));
+}
+
+#if CWJSON_THREADS
+
+// SharedDocument
+
+std::string sharedVersion(int version)
+{
+   std::ostringstream out;
+   out << "{\"version\":" << version << ",\"data\":[";
+   for (int i = 0; i < 16; ++i)
+      out << (i ? "," : "") << version;
+   out << "]}";
+   return out.str();
+}
+
+// Readers must always see one whole version, and never an older one than before
+void sharedConcurrent()
+{
+   cwjson::SharedDocument document;
+   document.publish(sharedVersion(0));
+
+   std::atomic<bool>        done(false);
+   std::atomic<int>         failures(0);
+   std::vector<std::thread> readers;
+
+   for (int r = 0; r < 4; ++r)
+   {
+      readers.push_back(std::thread([&]() {
+         double last = 0;
+         while (!done)
+         {
+            cwjson::SharedDocument::Snapshot snapshot = document.read();
+            const cwjson::Object            &object   = snapshot->getObject();
+            double                           version  = object.getNumber("version").getValue();
+
+            if (version < last)
+               failures++;
+            for (const cwjson::Value *it = object.getArray("data").firstChild(); it; it = it->nextSibling())
+            {
+               if (it->toNumber().getValue() != version)
+                  failures++;
+            }
+            last = version;
+         }
+      }));
+   }
+
+   for (int version = 1; version <= 500; ++version)
+      document.publish(sharedVersion(version));
+   done = true;
+   for (size_t i = 0; i < readers.size(); ++i)
+      readers[i].join();
+
+   CHECK(failures == 0);
+   CHECK(document.read()->getObject().getNumber("version").getValue() == 500);
+
+   // bad JSON keeps the current version
+   CHECK_THROWS(document.publish("{\"version\":"));
+   CHECK(document.read()->getObject().getNumber("version").getValue() == 500);
+}
+
+void sharedHeldSnapshot()
+{
+   cwjson::SharedDocument first, second;
+   first.publish("[1]");
+   second.publish("[2]");
+
+   {
+      cwjson::SharedDocument::Snapshot snapshot = first.read();
+      CHECK_THROWS(first.publish("[3]"));
+
+      // snapshot of another document doesn't block
+      second.publish("[4]");
+
+      cwjson::SharedDocument::Snapshot moved(std::move(snapshot));
+      CHECK_THROWS(first.publish("[5]"));
+   }
+
+   first.publish("[6]");
+   CHECK(compact(*first.read()) == "[6]");
+
+   // a snapshot taken on a thread that has exited is released on this one
+   cwjson::SharedDocument::Snapshot *handed = 0;
+   std::thread                       taker([&]() { handed = new cwjson::SharedDocument::Snapshot(first.read()); });
+   taker.join();
+   delete handed;
+   first.publish("[7]");
+   CHECK(compact(*first.read()) == "[7]");
+}
+
+void waitFor(const std::atomic<bool> &flag)
+{
+   while (!flag)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// publish() drains the counter of the old epoch, then the one readers switched to during the first drain
+void sharedEpochs()
+{
+   cwjson::SharedDocument document;
+   document.publish(sharedVersion(1));
+
+   std::atomic<bool> firstTaken(false), firstRelease(false), secondTaken(false), secondRelease(false), published(false);
+   std::atomic<int>  failures(0);
+
+   std::thread first([&]() {
+      cwjson::SharedDocument::Snapshot snapshot = document.read();
+      firstTaken = true;
+      waitFor(firstRelease);
+      // old tree stays alive while publish() waits
+      if (snapshot->getObject().getArray("data").lastChild()->toNumber().getValue() != 1)
+         failures++;
+   });
+   waitFor(firstTaken);
+
+   std::thread publisher([&]() {
+      document.publish(sharedVersion(2));
+      published = true;
+   });
+   std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   CHECK(!published);
+
+   // a reader arriving during the drain sees the new tree and counts in the other epoch
+   std::thread second([&]() {
+      cwjson::SharedDocument::Snapshot snapshot = document.read();
+      if (snapshot->getObject().getNumber("version").getValue() != 2)
+         failures++;
+      secondTaken = true;
+      waitFor(secondRelease);
+   });
+   waitFor(secondTaken);
+
+   firstRelease = true;
+   first.join();
+   std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   CHECK(!published);
+
+   secondRelease = true;
+   second.join();
+   publisher.join();
+   CHECK(published);
+   CHECK(failures == 0);
+}
+
+// Const lookup on an adaptive object doesn't reorder it, so readers can share one snapshot
+void sharedAdaptiveLookup()
+{
+   cwjson::Root *root = new cwjson::Root;
+   std::string   text = "{";
+   for (int i = 0; i < 64; ++i)
+   {
+      std::ostringstream out;
+      out << (i ? "," : "") << "\"key" << i << "\":" << i;
+      text += out.str();
+   }
+   root->parse((text + "}").c_str());
+   root->getObject().setAdaptiveLookup(true);
+
+   // non-const lookup moves members to the front, values don't change
+   CHECK(root->getObject().getNumber("key63").getValue() == 63);
+   CHECK(root->getObject().getNumber("key7").getValue() == 7);
+
+   cwjson::SharedDocument document;
+   document.publish(root);
+
+   std::atomic<int>         failures(0);
+   std::vector<std::thread> readers;
+   for (int r = 0; r < 4; ++r)
+   {
+      readers.push_back(std::thread([&, r]() {
+         cwjson::SharedDocument::Snapshot snapshot = document.read();
+         for (int n = 0; n < 20000; ++n)
+         {
+            int                key = (n * 7 + r * 13) % 64;
+            std::ostringstream name;
+            name << "key" << key;
+            if (snapshot->getObject().getNumber(name.str().c_str()).getValue() != key)
+               failures++;
+         }
+      }));
+   }
+   for (size_t i = 0; i < readers.size(); ++i)
+      readers[i].join();
+
+   CHECK(failures == 0);
+   CHECK_THROWS(document.read()->getObject().getValue("missing"));
+}
+
+// DocumentCache
+
+void documentCache()
+{
+   cwjson::DocumentCache cache;
+
+   // buffers are not zero terminated, the length ends the document
+   const char text[] = { '[', '1', ']', '[', '2', ']' };
+   std::shared_ptr<const cwjson::Root> first  = cache.parse(text, 3);
+   std::shared_ptr<const cwjson::Root> second = cache.parse(text + 3, 3);
+   std::shared_ptr<const cwjson::Root> again  = cache.parse(std::string("[1]"));
+
+   CHECK(compact(*first) == "[1]");
+   CHECK(compact(*second) == "[2]");
+   CHECK(again == first);
+   CHECK(cache.stats().hits == 1 && cache.stats().misses == 2);
+
+   CHECK_THROWS(cache.parse(text, sizeof(text)));
+   CHECK_THROWS(cache.parse(std::string("[1]\0", 4)));
+   CHECK(cache.stats().entries == 2);
+}
+
+// NodePool and ParserPool
+
+// Trees parsed on one thread and deleted on another, blocks travel back through the shared depot
+void poolHandoff()
+{
+   cwjson::BoundedQueue<cwjson::Root *> queue(8);
+   std::string                          text = "[";
+   for (int i = 0; i < 500; ++i)
+      text += i ? ",{\"id\":1,\"ok\":true}" : "{\"id\":1,\"ok\":true}";
+   text += "]";
+
+   std::thread producer([&]() {
+      for (int i = 0; i < 200; ++i)
+      {
+         cwjson::Root *root = new cwjson::Root(text.c_str());
+         while (!queue.tryPush(root))
+            std::this_thread::yield();
+      }
+      cwjson::NodePool::trim();
+   });
+
+   size_t        nodes = 0;
+   cwjson::Root *root;
+   for (int i = 0; i < 200; ++i)
+   {
+      while (!queue.tryPop(root))
+         std::this_thread::yield();
+      nodes += root->getArray().childCount();
+      delete root;
+   }
+   producer.join();
+   CHECK(nodes == 200 * 500);
+}
+
+void parserPoolFailure()
+{
+   cwjson::ParserPool pool;
+   cwjson::Root      *root = pool.parse("{\"a\":[1,2,3]}");
+   pool.release(root);
+
+   // failed parse returns its root to the pool, cleared
+   CHECK_THROWS(pool.parse("{\"a\":[1,2,"));
+   cwjson::Root *reused = pool.acquire();
+   CHECK(reused == root);
+   CHECK(reused->getType() == cwjson::TypeRoot && !reused->firstChild());
+   pool.release(reused);
+
+   root = pool.parse("[true]");
+   CHECK(compact(*root) == "[true]");
+   pool.release(root);
+}
+
+// ParallelTraversal
+
+class SumVisitor : public cwjson::ParallelVisitor
+{
+public:
+   SumVisitor(cwjson::ParallelTraversal *nested = 0) : sum(0), nested(nested) {}
+
+   cwjson::ParallelVisitor *split() { return new SumVisitor(nested); }
+   void                     merge(cwjson::ParallelVisitor &part) { sum += static_cast<SumVisitor &>(part).sum; }
+
+   bool visit(const cwjson::Number &value)
+   {
+      if (nested)
+      {
+         SumVisitor inner;
+         nested->traverse(value, inner);
+      }
+      sum += value.getValue();
+      return true;
+   }
+
+   double                     sum;
+   cwjson::ParallelTraversal *nested;
+};
+
+void parallelTraversal()
+{
+   std::string text = "[";
+   for (int i = 0; i < 20000; ++i)
+   {
+      std::ostringstream out;
+      out << (i ? "," : "") << (i % 7 ? "1" : "[1,1]");
+      text += out.str();
+   }
+   cwjson::Root root((text + "]").c_str());
+
+   cwjson::ParallelTraversal traversal(4, 64);
+   for (int pass = 0; pass < 20; ++pass)
+   {
+      SumVisitor visitor;
+      CHECK(traversal.traverse(root, visitor));
+      CHECK(visitor.sum == 20000 + 20000 / 7 + 1);
+   }
+
+   // reentrant call from a visitor fails the traversal, the pool stays usable
+   SumVisitor reentrant(&traversal);
+   CHECK_THROWS(traversal.traverse(root, reentrant));
+
+   SumVisitor visitor;
+   CHECK(traversal.traverse(root, visitor));
+   CHECK(visitor.sum == 20000 + 20000 / 7 + 1);
+}
+
+// Pipeline and BoundedQueue
+
+struct Collector : public cwjson::PipelineConsumer
+{
+   void consume(cwjson::Root &root, size_t sequence)
+   {
+      sequences.push_back(sequence);
+      values.push_back(root.getObject().getNumber("i").getValue());
+   }
+
+   void failed(const std::string &document, size_t sequence, const cwjson::JsonError &error)
+   {
+      failures.push_back(sequence);
+   }
+
+   std::vector<size_t> sequences;
+   std::vector<double> values;
+   std::vector<size_t> failures;
+};
+
+void pipelineOrder()
+{
+   // every 97th document is broken
+   std::string text;
+   const int   count = 3000;
+   for (int i = 0; i < count; ++i)
+   {
+      std::ostringstream out;
+      if (i % 97 == 13)
+         out << "{\"i\":" << i << ",]\n";
+      else
+         out << "{\"i\":" << i << ",\"pad\":\"" << std::string(i % 50, 'x') << "\"}\n";
+      text += out.str();
+   }
+
+   for (int ordered = 0; ordered < 2; ++ordered)
+   {
+      Collector          collector;
+      cwjson::Pipeline   pipeline(collector, 4, 8, ordered != 0);
+      std::istringstream in(text);
+      pipeline.run(in, 4096);
+
+      CHECK(pipeline.stats().documents == (size_t)count);
+      CHECK(collector.sequences.size() + collector.failures.size() == (size_t)count);
+
+      std::set<size_t> seen;
+      for (size_t i = 0; i < collector.sequences.size(); ++i)
+      {
+         CHECK(collector.values[i] == (double)collector.sequences[i]);
+         seen.insert(collector.sequences[i]);
+         if (ordered && i)
+            CHECK(collector.sequences[i] > collector.sequences[i - 1]);
+      }
+      for (size_t i = 0; i < collector.failures.size(); ++i)
+      {
+         CHECK(collector.failures[i] % 97 == 13);
+         seen.insert(collector.failures[i]);
+      }
+      CHECK(seen.size() == (size_t)count);
+   }
+}
+
+void pipelineLines()
+{
+   // every 97th line is cut short, every 101st has trailing data
+   std::string text;
+   const int   count = 2000;
+   for (int i = 0; i < count; ++i)
+   {
+      std::ostringstream out;
+      if (i % 97 == 13)
+         out << "{\"i\":" << i << ",\n";
+      else if (i % 101 == 7)
+         out << "{\"i\":" << i << "} x\n";
+      else
+         out << "{\"i\":" << i << "}\n\n";
+      text += out.str();
+   }
+
+   Collector          collector;
+   cwjson::Pipeline   pipeline(collector, 3, 4, true, cwjson::SplitLines);
+   std::istringstream in(text);
+   pipeline.run(in, 1000);
+
+   CHECK(pipeline.stats().documents == (size_t)count);
+   CHECK(collector.sequences.size() + collector.failures.size() == (size_t)count);
+   for (size_t i = 0; i < collector.sequences.size(); ++i)
+      CHECK(collector.values[i] == (double)collector.sequences[i]);
+   for (size_t i = 0; i < collector.failures.size(); ++i)
+      CHECK(collector.failures[i] % 97 == 13 || collector.failures[i] % 101 == 7);
+}
+
+// Stages sleep on the eventcount behind a slow consumer, an exception from the consumer wakes and stops them
+struct SlowConsumer : public cwjson::PipelineConsumer
+{
+   SlowConsumer(size_t throwAt) : consumed(0), throwAt(throwAt) {}
+
+   void consume(cwjson::Root &root, size_t sequence)
+   {
+      if (sequence == throwAt)
+         throw std::runtime_error("consumer failed");
+      if (sequence % 50 == 0)
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      consumed++;
+   }
+
+   size_t consumed;
+   size_t throwAt;
+};
+
+void pipelineSleep()
+{
+   std::string text;
+   for (int i = 0; i < 1000; ++i)
+      text += "[1,2,3]\n";
+
+   SlowConsumer     slow((size_t)-1);
+   cwjson::Pipeline pipeline(slow, 4, 1, false);
+   std::istringstream in(text);
+   pipeline.run(in, 64);
+   CHECK(slow.consumed == 1000);
+
+   SlowConsumer     failing(300);
+   cwjson::Pipeline stopped(failing, 4, 2, true);
+   for (int pass = 0; pass < 2; ++pass)
+   {
+      std::istringstream again(text);
+      bool               thrown = false;
+      try
+      {
+         stopped.run(again, 64);
+      }
+      catch (std::runtime_error &)
+      {
+         thrown = true;
+      }
+      CHECK(thrown);
+   }
+   CHECK(failing.consumed == 600);
+}
+
+void boundedQueue()
+{
+   cwjson::BoundedQueue<size_t> queue(16);
+   std::atomic<size_t>          sum(0);
+   std::atomic<size_t>          popped(0);
+   const size_t                 perProducer = 20000;
+   std::vector<std::thread>     threads;
+
+   for (int p = 0; p < 2; ++p)
+   {
+      threads.push_back(std::thread([&]() {
+         for (size_t i = 1; i <= perProducer; ++i)
+         {
+            while (!queue.tryPush(i))
+               std::this_thread::yield();
+         }
+      }));
+   }
+   for (int c = 0; c < 2; ++c)
+   {
+      threads.push_back(std::thread([&]() {
+         size_t value;
+         while (popped < 2 * perProducer)
+         {
+            if (queue.tryPop(value))
+            {
+               sum += value;
+               popped++;
+            }
+            else
+               std::this_thread::yield();
+         }
+      }));
+   }
+   for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+
+   CHECK(popped == 2 * perProducer);
+   CHECK(sum == perProducer * (perProducer + 1));
+   CHECK(queue.size() == 0);
+}
+
+#endif
+
+struct Test
+{
+   const char *name;
+   void      (*run)();
+};
+
+const Test tests[] =
+{
+   { "incremental/budgets", incrementalBudgets },
+   { "incremental/errors", incrementalErrors },
+   { "incremental/strict", incrementalStrict },
+   { "utf16/surrogates", utf16Surrogates },
+   { "utf16/overlong", utf8Overlong },
+   { "utf16/roundtrip", utf16RoundTrip },
+   { "gather/print", gatherPrint },
+   { "base64/canonical", base64Canonical },
+   { "recordindex/saveload", recordIndexSaveLoad },
+   { "splitter/chunks", splitterChunks },
+   { "splitter/lines", splitterLines },
+#if CWJSON_THREADS
+   { "shared/concurrent", sharedConcurrent },
+   { "shared/held", sharedHeldSnapshot },
+   { "shared/epochs", sharedEpochs },
+   { "shared/adaptive", sharedAdaptiveLookup },
+   { "cache/parse", documentCache },
+   { "pool/handoff", poolHandoff },
+   { "pool/parserfailure", parserPoolFailure },
+   { "parallel/traversal", parallelTraversal },
+   { "pipeline/order", pipelineOrder },
+   { "pipeline/lines", pipelineLines },
+   { "pipeline/sleep", pipelineSleep },
+   { "queue/bounded", boundedQueue },
+#endif
+};
+
+bool selected(const char *name, int argc, char *argv[])
+{
+   if (argc < 2)
+      return true;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+         return true;
+   }
+   return false;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+   int failed = 0;
+   for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+   {
+      if (!selected(tests[i].name, argc, argv))
+         continue;
+
+      int before = g_failures;
+      try
+      {
+         tests[i].run();
+      }
+      catch (std::exception &e)
+      {
+         printf("  unexpected exception: %s\n", e.what());
+         g_failures++;
+      }
+
+      bool ok = g_failures == before;
+      printf("%-32s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+      fflush(stdout);
+      failed += ok ? 0 : 1;
+   }
+
+   if (failed)
+      printf("%d test(s) failed\n", failed);
+   return failed ? 1 : 0;
+}
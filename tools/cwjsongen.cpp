@@ -0,0 +1,753 @@
+/*
+   Copyright (c) 2012 Sergej Kravcenko
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/*
+   cwjsongen - generates C++ structs with specialized parse() and print()
+   functions from sample JSON documents or from JSON Schema.
+
+   Usage: cwjsongen [--schema] [--name Type] [--namespace ns] [-o out.h] file...
+*/
+
+#include "../cwjson.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <ctype.h>
+
+namespace {
+
+enum Kind
+{
+   KindUnknown,
+   KindNumber,
+   KindString,
+   KindBoolean,
+   KindObject,
+   KindArray,
+   KindMixed
+};
+
+struct Type;
+
+struct Field
+{
+   std::string key;
+   std::string member;
+   Type       *type;
+};
+
+struct Type
+{
+   Type() : kind(KindUnknown), nullable(false), items(0) {}
+
+   Kind               kind;
+   bool               nullable;
+   std::string        name;
+   std::vector<Field> fields;
+   Type              *items;
+};
+
+class Generator
+{
+public:
+   Generator() : m_root(0) {}
+   ~Generator()
+   {
+      for (size_t i = 0; i < m_types.size(); ++i)
+         delete m_types[i];
+   }
+
+   void addSample(const cwjson::Value &value)
+   {
+      if (!m_root)
+         m_root = create();
+      merge(m_root, value);
+   }
+
+   void addSchema(const cwjson::Value &schema)
+   {
+      if (!m_root)
+         m_root = create();
+      fromSchema(m_root, schema);
+   }
+
+   void generate(std::ostream &out, const std::string &name, const std::string &space);
+
+private:
+   Type *create()
+   {
+      m_types.push_back(new Type());
+      return m_types.back();
+   }
+
+   void  setKind(Type *type, Kind kind);
+   void  merge(Type *type, const cwjson::Value &value);
+   void  fromSchema(Type *type, const cwjson::Value &schema);
+   Field &field(Type *type, const std::string &key);
+
+   void nameTypes(Type *type, const std::string &name);
+   void nameMembers(Type *type);
+   void emitStruct(std::ostream &out, Type *type);
+   void emitParse(std::ostream &out, Type *type, const std::string &target, const std::string &what, int indent);
+   void emitPrint(std::ostream &out, Type *type, const std::string &source, int indent);
+   void emitFunctions(std::ostream &out, Type *type);
+   void collect(Type *type, std::vector<Type *> &order);
+
+   static std::string cppType(Type *type);
+   static std::string identifier(const std::string &key);
+   static std::string literal(const std::string &str);
+   static std::string pad(int indent) { return std::string(indent * 3, ' '); }
+
+private:
+   Type                 *m_root;
+   std::vector<Type *>   m_types;
+   std::set<std::string> m_names;
+};
+
+void Generator::setKind(Type *type, Kind kind)
+{
+   if (type->kind == KindUnknown)
+      type->kind = kind;
+   else if (type->kind != kind)
+      type->kind = KindMixed;
+}
+
+Field &Generator::field(Type *type, const std::string &key)
+{
+   for (size_t i = 0; i < type->fields.size(); ++i)
+   {
+      if (type->fields[i].key == key)
+         return type->fields[i];
+   }
+
+   Field field;
+   field.key  = key;
+   field.type = create();
+   type->fields.push_back(field);
+   return type->fields.back();
+}
+
+void Generator::merge(Type *type, const cwjson::Value &value)
+{
+   switch (value.getType())
+   {
+   case cwjson::TypeRoot:
+      if (value.firstChild())
+         merge(type, *value.firstChild());
+      break;
+   case cwjson::TypeNull:
+      type->nullable = true;
+      break;
+   case cwjson::TypeNumber:
+      setKind(type, KindNumber);
+      break;
+   case cwjson::TypeString:
+      setKind(type, KindString);
+      break;
+   case cwjson::TypeBoolean:
+      setKind(type, KindBoolean);
+      break;
+   case cwjson::TypeObject:
+      setKind(type, KindObject);
+      for (const cwjson::Value *it = value.firstChild(); it; it = it->nextSibling())
+         merge(field(type, it->getNameStr()).type, *it);
+      break;
+   case cwjson::TypeArray:
+      setKind(type, KindArray);
+      if (!type->items)
+         type->items = create();
+      for (const cwjson::Value *it = value.firstChild(); it; it = it->nextSibling())
+         merge(type->items, *it);
+      break;
+   }
+}
+
+void Generator::fromSchema(Type *type, const cwjson::Value &schema)
+{
+   if (schema.getType() == cwjson::TypeRoot)
+   {
+      if (schema.firstChild())
+         fromSchema(type, *schema.firstChild());
+      return;
+   }
+
+   if (schema.getType() != cwjson::TypeObject)
+   {
+      setKind(type, KindMixed);
+      return;
+   }
+
+   const cwjson::Object &object = schema.toObject();
+   std::vector<std::string> kinds;
+
+   for (const cwjson::Value *it = object.firstChild(); it; it = it->nextSibling())
+   {
+      if (it->getNameStr() != "type")
+         continue;
+
+      if (it->getType() == cwjson::TypeString)
+         kinds.push_back(it->toString().getValueStr());
+      else if (it->getType() == cwjson::TypeArray)
+      {
+         for (const cwjson::Value *k = it->firstChild(); k; k = k->nextSibling())
+         {
+            if (k->getType() == cwjson::TypeString)
+               kinds.push_back(k->toString().getValueStr());
+         }
+      }
+   }
+
+   if (kinds.empty())
+      setKind(type, KindMixed);
+
+   for (size_t i = 0; i < kinds.size(); ++i)
+   {
+      if (kinds[i] == "null")
+         type->nullable = true;
+      else if (kinds[i] == "number" || kinds[i] == "integer")
+         setKind(type, KindNumber);
+      else if (kinds[i] == "string")
+         setKind(type, KindString);
+      else if (kinds[i] == "boolean")
+         setKind(type, KindBoolean);
+      else if (kinds[i] == "object")
+      {
+         setKind(type, KindObject);
+         for (const cwjson::Value *it = object.firstChild(); it; it = it->nextSibling())
+         {
+            if (it->getNameStr() == "properties" && it->getType() == cwjson::TypeObject)
+            {
+               for (const cwjson::Value *p = it->firstChild(); p; p = p->nextSibling())
+                  fromSchema(field(type, p->getNameStr()).type, *p);
+            }
+         }
+      }
+      else if (kinds[i] == "array")
+      {
+         setKind(type, KindArray);
+         if (!type->items)
+            type->items = create();
+         for (const cwjson::Value *it = object.firstChild(); it; it = it->nextSibling())
+         {
+            if (it->getNameStr() == "items")
+               fromSchema(type->items, *it);
+         }
+      }
+      else
+         setKind(type, KindMixed);
+   }
+}
+
+std::string Generator::identifier(const std::string &key)
+{
+   static const char *keywords[] =
+   {
+      "auto", "bool", "break", "case", "char", "class", "const", "default", "delete", "do", "double", "else", "enum",
+      "explicit", "false", "float", "for", "friend", "goto", "if", "int", "long", "namespace", "new", "operator",
+      "private", "protected", "public", "return", "short", "signed", "sizeof", "static", "struct", "switch",
+      "template", "this", "throw", "true", "try", "typedef", "union", "unsigned", "using", "virtual", "void",
+      "volatile", "while", 0
+   };
+
+   std::string result;
+   for (size_t i = 0; i < key.size(); ++i)
+   {
+      char c = key[i];
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+         result += c;
+      else
+         result += '_';
+   }
+
+   if (result.empty() || (result[0] >= '0' && result[0] <= '9'))
+      result = "_" + result;
+
+   for (int i = 0; keywords[i]; ++i)
+   {
+      if (result == keywords[i])
+         return result + "_";
+   }
+
+   return result;
+}
+
+std::string Generator::literal(const std::string &str)
+{
+   std::string result = "\"";
+   for (size_t i = 0; i < str.size(); ++i)
+   {
+      unsigned char c = (unsigned char)str[i];
+      if (c == '"' || c == '\\')
+      {
+         result += '\\';
+         result += (char)c;
+      }
+      else if (c < 32 || c >= 127)
+      {
+         char hex[8];
+         sprintf(hex, "\\%03o", c);
+         result += hex;
+      }
+      else
+         result += (char)c;
+   }
+   return result + "\"";
+}
+
+std::string Generator::cppType(Type *type)
+{
+   switch (type->kind)
+   {
+   case KindNumber:
+      return "double";
+   case KindString:
+      return "std::string";
+   case KindBoolean:
+      return "bool";
+   case KindObject:
+      return type->name;
+   case KindArray:
+      {
+         std::string item = cppType(type->items);
+         if (item.empty())
+            return "";
+         return "std::vector<" + item + (item[item.size() - 1] == '>' ? " >" : ">");
+      }
+   default:
+      return "";
+   }
+}
+
+void Generator::nameTypes(Type *type, const std::string &name)
+{
+   if (type->kind == KindArray)
+   {
+      nameTypes(type->items, name + "Item");
+      return;
+   }
+
+   if (type->kind != KindObject)
+      return;
+
+   std::string base = identifier(name);
+   base[0] = (char)toupper(base[0]);
+   if (base == identifier(name) && type != m_root)
+      base += "Type";
+
+   std::string unique = base;
+   for (int i = 2; m_names.count(unique); ++i)
+   {
+      std::ostringstream out;
+      out << base << i;
+      unique = out.str();
+   }
+
+   m_names.insert(unique);
+   type->name = unique;
+
+   for (size_t i = 0; i < type->fields.size(); ++i)
+      nameTypes(type->fields[i].type, type->fields[i].key);
+}
+
+// Different keys can map to the same identifier ("a-b" and "a_b", "x" and "has_x" flag), members get a number
+// suffix until the member and its has_ flag are unique in the struct and don't hide a type name
+void Generator::nameMembers(Type *type)
+{
+   std::set<std::string> used(m_names);
+
+   for (size_t i = 0; i < type->fields.size(); ++i)
+   {
+      std::string base   = identifier(type->fields[i].key);
+      std::string unique = base;
+      for (int n = 2; used.count(unique) || used.count("has_" + unique); ++n)
+      {
+         std::ostringstream out;
+         out << base << n;
+         unique = out.str();
+      }
+
+      used.insert(unique);
+      used.insert("has_" + unique);
+      type->fields[i].member = unique;
+   }
+}
+
+void Generator::collect(Type *type, std::vector<Type *> &order)
+{
+   if (type->kind == KindArray)
+      collect(type->items, order);
+
+   if (type->kind != KindObject)
+      return;
+
+   for (size_t i = 0; i < type->fields.size(); ++i)
+      collect(type->fields[i].type, order);
+   order.push_back(type);
+}
+
+void Generator::emitStruct(std::ostream &out, Type *type)
+{
+   out << "struct " << type->name << "\n{\n";
+   out << "   " << type->name << "()";
+
+   const char *sep = " : ";
+   for (size_t i = 0; i < type->fields.size(); ++i)
+   {
+      const Field &f = type->fields[i];
+      if (cppType(f.type).empty())
+         continue;
+
+      out << sep << "has_" << f.member << "(false)";
+      if (f.type->kind == KindNumber)
+         out << ", " << f.member << "(0)";
+      else if (f.type->kind == KindBoolean)
+         out << ", " << f.member << "(false)";
+      sep = ", ";
+   }
+   out << " {}\n\n";
+
+   for (size_t i = 0; i < type->fields.size(); ++i)
+   {
+      const Field &f    = type->fields[i];
+      std::string  name = cppType(f.type);
+      if (name.empty())
+         out << "   // " << literal(f.key) << " has no single type and is skipped\n";
+      else
+         out << "   bool " << "has_" << f.member << ";\n   " << name << " " << f.member << ";\n";
+   }
+   out << "};\n\n";
+}
+
+void Generator::emitParse(std::ostream &out, Type *type, const std::string &target, const std::string &what, int indent)
+{
+   std::string p = pad(indent);
+
+   switch (type->kind)
+   {
+   case KindNumber:
+      out << p << "if (*ptr != '-' && !cwjson::Scanner::isDigit(*ptr))\n";
+      out << p << "   throw cwjson::JsonError(\"expected number for " << what << "\");\n";
+      out << p << "ptr = cwjson::Scanner::parseNumber(" << target << ", ptr);\n";
+      break;
+   case KindString:
+      out << p << "if (*ptr != '\"')\n";
+      out << p << "   throw cwjson::JsonError(\"expected string for " << what << "\");\n";
+      out << p << "ptr = cwjson::Scanner::parseString(" << target << ", ptr);\n";
+      break;
+   case KindBoolean:
+      out << p << "if (strncmp(ptr, \"true\", 4) == 0)\n";
+      out << p << "{\n" << p << "   " << target << " = true;\n" << p << "   ptr += 4;\n" << p << "}\n";
+      out << p << "else if (strncmp(ptr, \"false\", 5) == 0)\n";
+      out << p << "{\n" << p << "   " << target << " = false;\n" << p << "   ptr += 5;\n" << p << "}\n";
+      out << p << "else\n";
+      out << p << "   throw cwjson::JsonError(\"expected boolean for " << what << "\");\n";
+      break;
+   case KindObject:
+      out << p << "ptr = parse(" << target << ", ptr);\n";
+      break;
+   case KindArray:
+      out << p << "if (*ptr != '[')\n";
+      out << p << "   throw cwjson::JsonError(\"expected array for " << what << "\");\n";
+      out << p << "ptr = cwjson::Scanner::whitespace(ptr + 1);\n";
+      out << p << "if (*ptr == ']')\n";
+      out << p << "   ++ptr;\n";
+      out << p << "else while (1)\n";
+      out << p << "{\n";
+      out << p << "   " << target << ".push_back(" << cppType(type->items) << "());\n";
+      if (type->items->nullable)
+      {
+         out << p << "   if (strncmp(ptr, \"null\", 4) == 0)\n";
+         out << p << "      ptr += 4;\n";
+         out << p << "   else\n";
+         out << p << "   {\n";
+         emitParse(out, type->items, target + ".back()", what + " item", indent + 2);
+         out << p << "   }\n";
+      }
+      else
+         emitParse(out, type->items, target + ".back()", what + " item", indent + 1);
+      out << p << "   ptr = cwjson::Scanner::whitespace(ptr);\n";
+      out << p << "   if (*ptr == ',')\n";
+      out << p << "   {\n";
+      out << p << "      ptr = cwjson::Scanner::whitespace(ptr + 1);\n";
+      out << p << "      continue;\n";
+      out << p << "   }\n";
+      out << p << "   if (*ptr != ']')\n";
+      out << p << "      throw cwjson::JsonError(\"expected ']' or ',' after array element\");\n";
+      out << p << "   ++ptr;\n";
+      out << p << "   break;\n";
+      out << p << "}\n";
+      break;
+   default:
+      out << p << "ptr = cwjson::Scanner::skipValue(ptr);\n";
+      break;
+   }
+}
+
+void Generator::emitPrint(std::ostream &out, Type *type, const std::string &source, int indent)
+{
+   std::string p = pad(indent);
+
+   switch (type->kind)
+   {
+   case KindNumber:
+      out << p << "printer.printNumber(" << source << ");\n";
+      break;
+   case KindString:
+      out << p << "printer.printEscapedString(" << source << ");\n";
+      break;
+   case KindBoolean:
+      out << p << "if (" << source << ")\n" << p << "   out.write(\"true\", 4);\n";
+      out << p << "else\n" << p << "   out.write(\"false\", 5);\n";
+      break;
+   case KindObject:
+      out << p << "print(out, " << source << ");\n";
+      break;
+   case KindArray:
+      {
+         std::ostringstream index;
+         index << "i" << indent;
+
+         out << p << "out << '[';\n";
+         out << p << "for (size_t " << index.str() << " = 0; " << index.str() << " < " << source << ".size(); ++" << index.str() << ")\n";
+         out << p << "{\n";
+         out << p << "   if (" << index.str() << ")\n";
+         out << p << "      out << ',';\n";
+         emitPrint(out, type->items, source + "[" + index.str() + "]", indent + 1);
+         out << p << "}\n";
+         out << p << "out << ']';\n";
+      }
+      break;
+   default:
+      break;
+   }
+}
+
+void Generator::emitFunctions(std::ostream &out, Type *type)
+{
+   // Parser: keys are matched by length first and then compared with memcmp
+   out << "inline const char *parse(" << type->name << " &out, const char *ptr)\n{\n";
+   out << "   std::string scratch;\n\n";
+   out << "   ptr = cwjson::Scanner::whitespace(ptr);\n";
+   out << "   if (*ptr != '{')\n";
+   out << "      throw cwjson::JsonError(\"expected object for " << type->name << "\");\n";
+   out << "   ptr = cwjson::Scanner::whitespace(ptr + 1);\n";
+   out << "   if (*ptr == '}')\n";
+   out << "      return ptr + 1;\n\n";
+   out << "   while (1)\n   {\n";
+   out << "      if (*ptr != '\"')\n";
+   out << "         throw cwjson::JsonError(\"expected object key\");\n\n";
+   out << "      const char *key;\n";
+   out << "      size_t      length;\n";
+   out << "      ptr = cwjson::Scanner::parseKey(key, length, scratch, ptr);\n\n";
+   out << "      switch (length)\n      {\n";
+
+   std::vector<size_t> lengths;
+   for (size_t i = 0; i < type->fields.size(); ++i)
+   {
+      if (!cppType(type->fields[i].type).empty() && std::find(lengths.begin(), lengths.end(), type->fields[i].key.size()) == lengths.end())
+         lengths.push_back(type->fields[i].key.size());
+   }
+   std::sort(lengths.begin(), lengths.end());
+
+   for (size_t l = 0; l < lengths.size(); ++l)
+   {
+      out << "      case " << lengths[l] << ":\n";
+      bool first = true;
+      for (size_t i = 0; i < type->fields.size(); ++i)
+      {
+         const Field &f = type->fields[i];
+         if (f.key.size() != lengths[l] || cppType(f.type).empty())
+            continue;
+
+         out << "         " << (first ? "if" : "else if") << " (memcmp(key, " << literal(f.key) << ", " << f.key.size() << ") == 0)\n";
+         out << "         {\n";
+         if (f.type->nullable)
+         {
+            out << "            if (strncmp(ptr, \"null\", 4) == 0)\n";
+            out << "               ptr += 4;\n";
+            out << "            else\n";
+            out << "            {\n";
+            emitParse(out, f.type, "out." + f.member, f.member, 5);
+            out << "               out.has_" << f.member << " = true;\n";
+            out << "            }\n";
+         }
+         else
+         {
+            emitParse(out, f.type, "out." + f.member, f.member, 4);
+            out << "            out.has_" << f.member << " = true;\n";
+         }
+         out << "            break;\n";
+         out << "         }\n";
+         first = false;
+      }
+      out << "         ptr = cwjson::Scanner::skipValue(ptr);\n";
+      out << "         break;\n";
+   }
+
+   out << "      default:\n";
+   out << "         ptr = cwjson::Scanner::skipValue(ptr);\n";
+   out << "         break;\n";
+   out << "      }\n\n";
+   out << "      ptr = cwjson::Scanner::whitespace(ptr);\n";
+   out << "      if (*ptr == ',')\n";
+   out << "      {\n";
+   out << "         ptr = cwjson::Scanner::whitespace(ptr + 1);\n";
+   out << "         continue;\n";
+   out << "      }\n";
+   out << "      if (*ptr != '}')\n";
+   out << "         throw cwjson::JsonError(\"expected '}' or ',' after object element\");\n";
+   out << "      return ptr + 1;\n";
+   out << "   }\n}\n\n";
+
+   // Printer: keys are written as pre-escaped literals
+   out << "inline void print(std::ostream &out, const " << type->name << " &value)\n{\n";
+   out << "   cwjson::Printer printer(out);\n";
+   out << "   bool            first = true;\n\n";
+   out << "   out << '{';\n";
+   for (size_t i = 0; i < type->fields.size(); ++i)
+   {
+      const Field &f = type->fields[i];
+      if (cppType(f.type).empty())
+         continue;
+
+      std::ostringstream key;
+      cwjson::Printer    keyPrinter(key);
+      keyPrinter.printEscapedString(f.key);
+      key << ':';
+
+      out << "   if (value.has_" << f.member << ")\n   {\n";
+      out << "      if (!first)\n";
+      out << "         out << ',';\n";
+      out << "      first = false;\n";
+      out << "      out.write(" << literal(key.str()) << ", " << key.str().size() << ");\n";
+      emitPrint(out, f.type, "value." + f.member, 2);
+      out << "   }\n";
+   }
+   out << "   out << '}';\n";
+   out << "}\n\n";
+}
+
+void Generator::generate(std::ostream &out, const std::string &name, const std::string &space)
+{
+   if (!m_root || m_root->kind != KindObject)
+      throw cwjson::JsonError("top level value must be an object");
+
+   nameTypes(m_root, name);
+
+   std::vector<Type *> order;
+   collect(m_root, order);
+   for (size_t i = 0; i < order.size(); ++i)
+      nameMembers(order[i]);
+
+   std::string guard = "__" + identifier(space.empty() ? name : space + "_" + name) + "_JSON_H__";
+   for (size_t i = 0; i < guard.size(); ++i)
+      guard[i] = (char)toupper(guard[i]);
+
+   out << "// Generated by cwjsongen. Do not edit.\n\n";
+   out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+   out << "#include \"cwjson.h\"\n\n#include <string>\n#include <vector>\n\n";
+   if (!space.empty())
+      out << "namespace " << space << " {\n\n";
+
+   for (size_t i = 0; i < order.size(); ++i)
+      emitStruct(out, order[i]);
+   for (size_t i = 0; i < order.size(); ++i)
+      emitFunctions(out, order[i]);
+
+   if (!space.empty())
+      out << "}\n\n";
+   out << "#endif\n";
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+   bool                     schema = false;
+   std::string              name = "Document";
+   std::string              space;
+   std::string              output;
+   std::vector<std::string> inputs;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+      if (arg == "--schema")
+         schema = true;
+      else if (arg == "--name" && i + 1 < argc)
+         name = argv[++i];
+      else if (arg == "--namespace" && i + 1 < argc)
+         space = argv[++i];
+      else if (arg == "-o" && i + 1 < argc)
+         output = argv[++i];
+      else
+         inputs.push_back(arg);
+   }
+
+   if (inputs.empty())
+   {
+      std::cerr << "usage: cwjsongen [--schema] [--name Type] [--namespace ns] [-o out.h] file..." << std::endl;
+      return 1;
+   }
+
+   try
+   {
+      Generator generator;
+
+      for (size_t i = 0; i < inputs.size(); ++i)
+      {
+         std::ifstream in(inputs[i].c_str(), std::ios::binary);
+         if (!in)
+         {
+            std::cerr << "cwjsongen: can't open " << inputs[i] << std::endl;
+            return 1;
+         }
+
+         std::ostringstream buffer;
+         buffer << in.rdbuf();
+
+         cwjson::Root root(buffer.str().c_str());
+         if (schema)
+            generator.addSchema(root);
+         else
+            generator.addSample(root);
+      }
+
+      if (output.empty())
+         generator.generate(std::cout, name, space);
+      else
+      {
+         std::ofstream out(output.c_str(), std::ios::binary);
+         generator.generate(out, name, space);
+      }
+   }
+   catch (cwjson::JsonError &e)
+   {
+      std::cerr << "cwjsongen: " << e.what() << std::endl;
+      return 1;
+   }
+
+   return 0;
+}
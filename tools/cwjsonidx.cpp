@@ -0,0 +1,108 @@
+/*
+   Copyright (c) 2012 Sergej Kravcenko
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/*
+   cwjsonidx - builds record offset index for NDJSON file, stores it in file.idx next to the data and prints
+   selected records. Index is rebuilt when data file size doesn't match the stored one.
+
+   Usage: cwjsonidx [--rebuild] [--format] file.ndjson [record...]
+*/
+
+#include "../cwjson.h"
+
+#include <vector>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+   bool                rebuild = false;
+   bool                format  = false;
+   std::string         input;
+   std::vector<size_t> records;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+      if (arg == "--rebuild")
+         rebuild = true;
+      else if (arg == "--format")
+         format = true;
+      else if (input.empty())
+         input = arg;
+      else
+         records.push_back((size_t)strtoul(arg.c_str(), 0, 10));
+   }
+
+   if (input.empty())
+   {
+      std::cerr << "usage: cwjsonidx [--rebuild] [--format] file.ndjson [record...]" << std::endl;
+      return 1;
+   }
+
+   FILE *file = fopen(input.c_str(), "rb");
+   if (!file)
+   {
+      std::cerr << "cwjsonidx: can't open " << input << std::endl;
+      return 1;
+   }
+
+   std::string         path = input + ".idx";
+   cwjson::RecordIndex index;
+
+   // Only file size is checked, in-place rewrites of the same length need --rebuild.
+   bool fresh = !rebuild && index.load(path.c_str()) && index.matches(file);
+   if (!fresh)
+   {
+      if (!index.build(file))
+      {
+         std::cerr << "cwjsonidx: can't read " << input << std::endl;
+         fclose(file);
+         return 1;
+      }
+      if (!index.save(path.c_str()))
+         std::cerr << "cwjsonidx: can't write " << path << std::endl;
+   }
+
+   int result = 0;
+   try
+   {
+      if (records.empty())
+         std::cout << index.size() << " records" << std::endl;
+
+      for (size_t i = 0; i < records.size(); ++i)
+      {
+         cwjson::Root root;
+         index.record(file, records[i], root);
+         root.print(std::cout, format);
+         std::cout << std::endl;
+      }
+   }
+   catch (cwjson::JsonError &e)
+   {
+      std::cerr << "cwjsonidx: " << e.what() << std::endl;
+      result = 1;
+   }
+
+   fclose(file);
+   return result;
+}